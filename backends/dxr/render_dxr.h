@@ -56,7 +56,7 @@ struct RenderDXR : RenderBackend {
 
     void initialize(const int fb_width, const int fb_height) override;
 
-    void set_scene(const Scene &scene) override;
+    void set_scene(const std::shared_ptr<const Scene> &scene) override;
 
     void update_scene(const Scene &scene) override;
 
@@ -0,0 +1,21 @@
+// This header is shared between the C++ and ISPC code of the Embree backend
+
+#ifndef EMBREE_AOV_LAYOUT_H
+#define EMBREE_AOV_LAYOUT_H
+
+/* Offsets of the AOVs in each pixel's interleaved AOV values. The albedo, shading normal
+ * and depth are taken at the first non-specular hit, the direct lighting is the light
+ * reaching the camera after at most one bounce and the indirect lighting the rest. The
+ * IDs are those at the first hit of the frame's first sample, -1 for the background
+ */
+#define AOV_ALBEDO 0
+#define AOV_NORMAL 3
+#define AOV_DEPTH 6
+#define AOV_DIRECT 7
+#define AOV_INDIRECT 10
+#define AOV_INSTANCE_ID 13
+#define AOV_MATERIAL_ID 14
+#define AOV_SAMPLE_COUNT 15
+#define AOV_STRIDE 16
+
+#endif
@@ -0,0 +1,106 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "render_embree.h"
+#include "scene.h"
+#include "util.h"
+#include <glm/glm.hpp>
+
+/* Benchmark comparing the BVH build time, BVH memory use and render performance
+ * of the Embree BVH build quality presets and scene flags on a scene.
+ * Usage: bvh_build_bench <scene file> [-img <x> <y>] [-spp <n>] [-frames <n>]
+ */
+int main(int argc, const char **argv)
+{
+    const std::vector<std::string> args(argv, argv + argc);
+    std::string scene_file;
+    glm::uvec2 img_size(1280, 720);
+    uint32_t samples_per_pixel = 1;
+    int frames = 10;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "-img") {
+            img_size.x = std::stoi(args[++i]);
+            img_size.y = std::stoi(args[++i]);
+        } else if (args[i] == "-spp") {
+            samples_per_pixel = std::stoi(args[++i]);
+        } else if (args[i] == "-frames") {
+            frames = std::stoi(args[++i]);
+        } else if (args[i][0] != '-') {
+            scene_file = args[i];
+            canonicalize_path(scene_file);
+        }
+    }
+    if (scene_file.empty()) {
+        std::cout << "Usage: bvh_build_bench <scene file> [-img <x> <y>] [-spp <n>] "
+                     "[-frames <n>]\n";
+        return 1;
+    }
+
+    auto scene = std::make_shared<Scene>(scene_file, MaterialMode::DEFAULT);
+    scene->samples_per_pixel = samples_per_pixel;
+
+    glm::vec3 eye(0.f, 0.f, 5.f);
+    glm::vec3 dir(0.f, 0.f, -1.f);
+    glm::vec3 up(0.f, 1.f, 0.f);
+    float fov_y = 65.f;
+    if (!scene->cameras.empty()) {
+        eye = scene->cameras[0].position;
+        dir = glm::normalize(scene->cameras[0].center - scene->cameras[0].position);
+        up = scene->cameras[0].up;
+        fov_y = scene->cameras[0].fov_y;
+    }
+
+    std::cout << "Benchmarking '" << scene_file << "', "
+              << pretty_print_count(scene->total_tris()) << " triangles, rendering "
+              << frames << " frames at " << img_size.x << "x" << img_size.y << ", "
+              << samples_per_pixel << "spp\n";
+
+    struct Preset {
+        std::string name;
+        BVHQuality quality;
+        bool compact;
+        bool robust;
+    };
+    const std::vector<Preset> presets = {{"low", BVHQuality::LOW, false, false},
+                                         {"medium", BVHQuality::MEDIUM, false, false},
+                                         {"high", BVHQuality::HIGH, false, false},
+                                         {"medium compact", BVHQuality::MEDIUM, true, false},
+                                         {"medium robust", BVHQuality::MEDIUM, false, true}};
+    for (const auto &p : presets) {
+        scene->render_params.bvh_quality = p.quality;
+        scene->render_params.bvh_compact = p.compact;
+        scene->render_params.bvh_robust = p.robust;
+
+        RenderEmbree renderer;
+        renderer.initialize(img_size.x, img_size.y);
+        renderer.set_scene(scene);
+
+        // Warm up frame
+        renderer.render(eye, dir, up, fov_y, true, false);
+
+        double render_time = 0.0;
+        double rays_per_second = 0.0;
+        for (int i = 0; i < frames; ++i) {
+            const RenderStats stats = renderer.render(eye, dir, up, fov_y, i == 0, false);
+            render_time += stats.render_time;
+            rays_per_second += stats.rays_per_second;
+        }
+        render_time /= frames;
+        rays_per_second /= frames;
+
+        std::cout << "Preset " << p.name << ": build " << renderer.bvh_build_time << "ms, "
+                  << "BVH memory " << pretty_print_count(renderer.bvh_bytes) << "B, render "
+                  << render_time << "ms/frame";
+        if (rays_per_second > 0.0) {
+            std::cout << ", " << pretty_print_count(rays_per_second) << "Ray/s\n";
+        } else {
+            // Ray counts are only tracked when built with REPORT_RAY_STATS
+            const double samples_per_second = double(img_size.x) * img_size.y *
+                                              samples_per_pixel / (render_time * 1.0e-3);
+            std::cout << ", " << pretty_print_count(samples_per_second) << "samples/s\n";
+        }
+    }
+    return 0;
+}
@@ -1,31 +1,98 @@
 #include "embree_utils.h"
+#include "texture_compression.h"
 #include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iterator>
 #include <limits>
+#include <numeric>
+#include <tbb/parallel_for.h>
+#include "util.h"
 #include <glm/ext.hpp>
 
 namespace embree {
 
+BVHBuildParams::BVHBuildParams(const RenderParams &params)
+{
+    if (params.bvh_quality == BVHQuality::LOW) {
+        quality = RTC_BUILD_QUALITY_LOW;
+    } else if (params.bvh_quality == BVHQuality::HIGH) {
+        // High quality builds also use spatial splits for the triangle BVHs
+        quality = RTC_BUILD_QUALITY_HIGH;
+    }
+    if (params.bvh_compact) {
+        flags = RTCSceneFlags(flags | RTC_SCENE_FLAG_COMPACT);
+    }
+    if (params.bvh_robust) {
+        flags = RTCSceneFlags(flags | RTC_SCENE_FLAG_ROBUST);
+    }
+}
+
 Geometry::Geometry(RTCDevice &device,
-                   const std::vector<glm::vec3> &verts,
-                   const std::vector<glm::uvec3> &indices,
-                   const std::vector<glm::vec3> &normals,
-                   const std::vector<glm::vec2> &uvs)
-    : n_vertices(verts.size()),
-      vertex_buf(verts),
-      index_buf(indices),
-      normal_buf(normals),
-      uv_buf(uvs),
+                   const ::Geometry &geometry,
+                   const BVHBuildParams &build_params,
+                   const bool compact_attributes,
+                   const bool build_shading_records)
+    : n_vertices(geometry.vertices.size()),
+      vertices(geometry.vertices.data()),
+      indices(geometry.indices.data()),
+      n_indices(geometry.indices.size()),
       geom(rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE))
 {
-    // Pad the vertex_buf out to align it
-    vertex_buf.push_back(glm::vec3(0.f));
+    if (compact_attributes || geometry.vertices.capacity() == geometry.vertices.size()) {
+        vertex_buf.reserve(n_vertices + 1);
+        vertex_buf.assign(geometry.vertices.begin(), geometry.vertices.end());
+        vertex_buf.push_back(glm::vec3(0.f));
+        vertices = vertex_buf.data();
+    }
+    if (compact_attributes) {
+        index_buf = geometry.indices;
+        indices = index_buf.data();
+
+        if (!geometry.uvs.empty()) {
+            glm::vec2 uv_min = geometry.uvs[0];
+            glm::vec2 uv_max = geometry.uvs[0];
+            for (const auto &uv : geometry.uvs) {
+                uv_min = glm::min(uv_min, uv);
+                uv_max = glm::max(uv_max, uv);
+            }
+            uv_offset = uv_min;
+            uv_scale = glm::max(uv_max - uv_min, glm::vec2(std::numeric_limits<float>::min()));
+            packed_uvs.reserve(geometry.uvs.size());
+            for (const auto &uv : geometry.uvs) {
+                const glm::uvec2 q(
+                    glm::round(glm::clamp((uv - uv_offset) / uv_scale, 0.f, 1.f) * 65535.f));
+                packed_uvs.push_back(q.x | (q.y << 16));
+            }
+        }
+    } else {
+        if (!geometry.normals.empty()) {
+            normals = geometry.normals.data();
+        }
+        if (!geometry.uvs.empty()) {
+            uvs = geometry.uvs.data();
+        }
+    }
+
+    if (build_shading_records) {
+        shading_records.resize(geometry.indices.size());
+        for (size_t i = 0; i < geometry.indices.size(); ++i) {
+            const glm::uvec3 &tri = geometry.indices[i];
+            ShadingRecord &record = shading_records[i];
+            const glm::vec3 &va = geometry.vertices[tri.x];
+            record.edge_ab = geometry.vertices[tri.y] - va;
+            record.edge_ac = geometry.vertices[tri.z] - va;
+            for (int j = 0; j < 3; ++j) {
+                record.uvs[j] = geometry.uvs.empty() ? glm::vec2(0.f) : geometry.uvs[tri[j]];
+            }
+        }
+    }
 
     rtcSetSharedGeometryBuffer(geom,
                                RTC_BUFFER_TYPE_VERTEX,
                                0,
                                RTC_FORMAT_FLOAT3,
-                               vertex_buf.data(),
+                               vertices,
                                0,
                                sizeof(glm::vec3),
                                n_vertices);
@@ -33,11 +100,12 @@ Geometry::Geometry(RTCDevice &device,
                                RTC_BUFFER_TYPE_INDEX,
                                0,
                                RTC_FORMAT_UINT3,
-                               index_buf.data(),
+                               indices,
                                0,
                                sizeof(glm::uvec3),
-                               index_buf.size());
+                               n_indices);
 
+    rtcSetGeometryBuildQuality(geom, build_params.quality);
     rtcCommitGeometry(geom);
 }
 
@@ -48,21 +116,38 @@ Geometry::~Geometry()
     }
 }
 
+size_t Geometry::nbytes() const
+{
+    return vertex_buf.capacity() * sizeof(glm::vec3) +
+           index_buf.capacity() * sizeof(glm::uvec3) +
+           packed_uvs.capacity() * sizeof(uint32_t) +
+           shading_records.capacity() * sizeof(ShadingRecord);
+}
+
 ISPCGeometry::ISPCGeometry(const Geometry &geom)
-    : vertex_buf(geom.vertex_buf.data()), index_buf(geom.index_buf.data())
+    : vertex_buf(geom.vertices),
+      index_buf(geom.indices),
+      normal_buf(geom.normals),
+      uv_buf(geom.uvs),
+      uv_offset(geom.uv_offset),
+      uv_scale(geom.uv_scale)
 {
-    if (!geom.normal_buf.empty()) {
-        normal_buf = geom.normal_buf.data();
+    if (!geom.packed_uvs.empty()) {
+        packed_uv_buf = geom.packed_uvs.data();
     }
-
-    if (!geom.uv_buf.empty()) {
-        uv_buf = geom.uv_buf.data();
+    if (!geom.shading_records.empty()) {
+        shading_records = geom.shading_records.data();
     }
 }
 
-TriangleMesh::TriangleMesh(RTCDevice &device, std::vector<std::shared_ptr<Geometry>> &geoms)
+TriangleMesh::TriangleMesh(RTCDevice &device,
+                           std::vector<std::shared_ptr<Geometry>> &geoms,
+                           const BVHBuildParams &build_params)
     : scene(rtcNewScene(device)), geometries(geoms)
 {
+    rtcSetSceneBuildQuality(scene, build_params.quality);
+    rtcSetSceneFlags(scene, build_params.flags);
+
     ispc_geometries.reserve(geometries.size());
     std::transform(geometries.begin(),
                    geometries.end(),
@@ -103,6 +188,20 @@ Instance::Instance(RTCDevice &device,
     rtcCommitGeometry(handle);
 }
 
+Instance::Instance(RTCDevice &device,
+                   std::shared_ptr<InstanceGroup> &group,
+                   const glm::mat4 &xfm)
+    : handle(rtcNewGeometry(device, RTC_GEOMETRY_TYPE_INSTANCE)),
+      group(group),
+      object_to_world(xfm),
+      world_to_object(glm::inverse(object_to_world))
+{
+    rtcSetGeometryInstancedScene(handle, group->handle);
+    rtcSetGeometryTransform(
+        handle, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, glm::value_ptr(object_to_world));
+    rtcCommitGeometry(handle);
+}
+
 Instance::~Instance()
 {
     if (handle) {
@@ -110,17 +209,91 @@ Instance::~Instance()
     }
 }
 
+void Instance::set_mesh(const std::shared_ptr<TriangleMesh> &m)
+{
+    mesh = m;
+    rtcSetGeometryInstancedScene(handle, mesh->handle());
+    rtcCommitGeometry(handle);
+}
+
+/* Compute the matrix transforming normals by the linear part of the transform and
+ * classify it. For similarity transforms the inverse transpose is the rotation scaled
+ * by 1/s, so we can use the rotation instead and keep normals normalized
+ */
+static uint32_t compute_normal_matrix(const glm::mat4 &object_to_world,
+                                      glm::mat3 &normal_matrix)
+{
+    const glm::mat3 linear(object_to_world);
+    const float scale = glm::length(linear[0]);
+    const glm::mat3 gram = glm::transpose(linear) * linear;
+    const float eps = 1e-5f * scale * scale;
+    bool similarity = scale > 0.f;
+    for (int i = 0; i < 3 && similarity; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            const float expected = i == j ? scale * scale : 0.f;
+            if (std::abs(gram[i][j] - expected) > eps) {
+                similarity = false;
+                break;
+            }
+        }
+    }
+
+    if (!similarity) {
+        normal_matrix = glm::transpose(glm::inverse(linear));
+        return NORMAL_XFM_GENERAL;
+    }
+    normal_matrix = linear / scale;
+    const glm::mat3 identity(1.f);
+    for (int i = 0; i < 3; ++i) {
+        if (glm::length(normal_matrix[i] - identity[i]) > 1e-5f) {
+            return NORMAL_XFM_ORTHONORMAL;
+        }
+    }
+    return NORMAL_XFM_IDENTITY;
+}
+
 ISPCInstance::ISPCInstance(const Instance &instance)
-    : geometries(instance.mesh->ispc_geometries.data()),
-      object_to_world(glm::value_ptr(instance.object_to_world)),
-      world_to_object(glm::value_ptr(instance.world_to_object)),
+    : object_to_world(glm::value_ptr(instance.object_to_world)),
       material_ids(instance.material_ids.data())
 {
+    glm::mat3 normal_mat;
+    normal_xfm = compute_normal_matrix(instance.object_to_world, normal_mat);
+    std::memcpy(normal_matrix, glm::value_ptr(normal_mat), sizeof(normal_matrix));
+    if (instance.mesh) {
+        geometries = instance.mesh->ispc_geometries.data();
+    } else if (instance.group) {
+        group_instances = instance.group->ispc_instances.data();
+    }
 }
 
-TopLevelBVH::TopLevelBVH(RTCDevice &device, const std::vector<std::shared_ptr<Instance>> &inst)
+InstanceGroup::InstanceGroup(RTCDevice &device,
+                             const std::vector<std::shared_ptr<Instance>> &inst,
+                             const BVHBuildParams &build_params)
     : handle(rtcNewScene(device)), instances(inst)
 {
+    rtcSetSceneBuildQuality(handle, build_params.quality);
+    rtcSetSceneFlags(handle, build_params.flags);
+    for (const auto &i : instances) {
+        rtcAttachGeometry(handle, i->handle);
+        ispc_instances.push_back(*i);
+    }
+    rtcCommitScene(handle);
+}
+
+InstanceGroup::~InstanceGroup()
+{
+    if (handle) {
+        rtcReleaseScene(handle);
+    }
+}
+
+TopLevelBVH::TopLevelBVH(RTCDevice &device,
+                         const std::vector<std::shared_ptr<Instance>> &inst,
+                         const BVHBuildParams &build_params)
+    : handle(rtcNewScene(device)), instances(inst)
+{
+    rtcSetSceneBuildQuality(handle, build_params.quality);
+    rtcSetSceneFlags(handle, build_params.flags);
     for (const auto &i : instances) {
         rtcAttachGeometry(handle, i->handle);
         ispc_instances.push_back(*i);
@@ -135,8 +308,178 @@ TopLevelBVH::~TopLevelBVH()
     }
 }
 
-ISPCTexture2D::ISPCTexture2D(const Image &img)
-    : width(img.width), height(img.height), channels(img.channels), data(img.img.data())
+ISPCMipLevel::ISPCMipLevel(const Image &img)
+    : width(img.width), height(img.height), data(img.img.data())
+{
+}
+
+// Reorder the texels of the image into tiles, padding it out to a multiple of the tile size
+static void tile_image(Image &img)
+{
+    const size_t tiles_x = (img.width + TEXTURE_TILE_DIM - 1) / TEXTURE_TILE_DIM;
+    const size_t tiles_y = (img.height + TEXTURE_TILE_DIM - 1) / TEXTURE_TILE_DIM;
+    const size_t tile_texels = TEXTURE_TILE_DIM * TEXTURE_TILE_DIM;
+    std::vector<uint8_t> tiled(tiles_x * tiles_y * tile_texels * img.channels, 0);
+    for (size_t y = 0; y < size_t(img.height); ++y) {
+        for (size_t x = 0; x < size_t(img.width); ++x) {
+            const size_t tile = (y / TEXTURE_TILE_DIM) * tiles_x + x / TEXTURE_TILE_DIM;
+            const size_t texel = tile * tile_texels +
+                                 (y % TEXTURE_TILE_DIM) * TEXTURE_TILE_DIM +
+                                 x % TEXTURE_TILE_DIM;
+            std::memcpy(&tiled[texel * img.channels],
+                        &img.img[(y * img.width + x) * img.channels],
+                        img.channels);
+        }
+    }
+    img.img = std::move(tiled);
+}
+
+void linearize_srgb(Image &img)
+{
+    if (img.color_space != SRGB) {
+        return;
+    }
+    img.color_space = LINEAR;
+    const int convert_channels = std::min(3, img.channels);
+    tbb::parallel_for(size_t(0), size_t(img.width) * img.height, [&](size_t px) {
+        for (int c = 0; c < convert_channels; ++c) {
+            float x = img.img[px * img.channels + c] / 255.f;
+            x = srgb_to_linear(x);
+            img.img[px * img.channels + c] = glm::clamp(x * 255.f, 0.f, 255.f);
+        }
+    });
+}
+
+Image next_mip_level(const Image &prev)
+{
+    Image next;
+    next.name = prev.name;
+    next.width = std::max(prev.width / 2, 1);
+    next.height = std::max(prev.height / 2, 1);
+    next.channels = prev.channels;
+    next.color_space = prev.color_space;
+    next.img.resize(size_t(next.width) * next.height * next.channels);
+    for (int y = 0; y < next.height; ++y) {
+        const int y_start = y * 2;
+        const int y_end = y == next.height - 1 ? prev.height : y_start + 2;
+        for (int x = 0; x < next.width; ++x) {
+            const int x_start = x * 2;
+            const int x_end = x == next.width - 1 ? prev.width : x_start + 2;
+            for (int c = 0; c < next.channels; ++c) {
+                uint32_t sum = 0;
+                for (int j = y_start; j < y_end; ++j) {
+                    for (int i = x_start; i < x_end; ++i) {
+                        sum += prev.img[(size_t(j) * prev.width + i) * prev.channels + c];
+                    }
+                }
+                const uint32_t count = (y_end - y_start) * (x_end - x_start);
+                next.img[(size_t(y) * next.width + x) * next.channels + c] =
+                    (sum + count / 2) / count;
+            }
+        }
+    }
+    return next;
+}
+
+Texture2D::Texture2D(Image img, const TextureLayout texture_layout)
+{
+    if (texture_layout == TextureLayout::TILED) {
+        layout = TEXTURE_LAYOUT_TILED;
+    } else if (texture_layout == TextureLayout::COMPRESSED) {
+        layout = select_compressed_layout(img);
+    }
+
+    levels.push_back(std::move(img));
+    while (levels.back().width > 1 || levels.back().height > 1) {
+        levels.push_back(next_mip_level(levels.back()));
+    }
+
+    if (layout == TEXTURE_LAYOUT_TILED) {
+        for (auto &l : levels) {
+            tile_image(l);
+        }
+    } else if (layout != TEXTURE_LAYOUT_LINEAR) {
+        for (auto &l : levels) {
+            l.img = compress_image(l, layout);
+        }
+    }
+
+    ispc_levels.reserve(levels.size());
+    std::transform(levels.begin(),
+                   levels.end(),
+                   std::back_inserter(ispc_levels),
+                   [](const Image &level) { return ISPCMipLevel(level); });
+}
+
+Texture2D::Texture2D(TextureCache *cache,
+                     std::vector<Image> cached_levels,
+                     const std::vector<uint64_t> &first_cache_tiles)
+    : layout(TEXTURE_LAYOUT_CACHED), levels(std::move(cached_levels)), cache(cache)
+{
+    for (size_t i = 0; i < levels.size(); ++i) {
+        ISPCMipLevel level(levels[i]);
+        level.data = nullptr;
+        level.first_cache_tile = first_cache_tiles[i];
+        ispc_levels.push_back(level);
+    }
+}
+
+ISPCTexture2D::ISPCTexture2D(const Texture2D &tex)
+    : width(tex.levels[0].width),
+      height(tex.levels[0].height),
+      channels(tex.levels[0].channels),
+      num_levels(tex.levels.size()),
+      layout(tex.layout),
+      levels(tex.ispc_levels.data()),
+      cache(tex.cache)
+{
+}
+
+std::vector<AliasEntry> build_alias_table(const std::vector<float> &weights)
+{
+    const size_t n = weights.size();
+    std::vector<AliasEntry> table(n);
+    const double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+
+    // Split the entries into those with less and more than the average probability,
+    // then fill up each under-full entry with an alias to an over-full one (Vose's method)
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> under, over;
+    for (size_t i = 0; i < n; ++i) {
+        table[i].pmf = total > 0.0 ? weights[i] / total : 1.0 / n;
+        table[i].alias = i;
+        scaled[i] = total > 0.0 ? n * weights[i] / total : 1.0;
+        if (scaled[i] < 1.0) {
+            under.push_back(i);
+        } else {
+            over.push_back(i);
+        }
+    }
+    while (!under.empty() && !over.empty()) {
+        const uint32_t u = under.back();
+        under.pop_back();
+        const uint32_t o = over.back();
+
+        table[u].prob = scaled[u];
+        table[u].alias = o;
+        scaled[o] = (scaled[o] + scaled[u]) - 1.0;
+        if (scaled[o] < 1.0) {
+            over.pop_back();
+            under.push_back(o);
+        }
+    }
+    // Any entries left over are full, up to rounding error
+    for (const auto &i : under) {
+        table[i].prob = 1.f;
+    }
+    for (const auto &i : over) {
+        table[i].prob = 1.f;
+    }
+    return table;
+}
+
+float light_power(const QuadLight &light)
 {
+    return luminance(glm::vec3(light.emission)) * light.width * light.height;
 }
 }
@@ -4,33 +4,86 @@
 #include <utility>
 #include <vector>
 #include <embree4/rtcore.h>
+#include <tbb/cache_aligned_allocator.h>
+#include "environment_map.h"
+#include "light_bvh.h"
 #include "lights.h"
 #include "material.h"
+#include "mesh.h"
+#include "normal_transform.h"
+#include "path_guide.h"
+#include "radiance_cache.h"
+#include "render_params.h"
+#include "texture_layout.h"
 #include <glm/glm.hpp>
 
 namespace embree {
 
+// The Embree build quality and scene flags to build the BVHs with
+struct BVHBuildParams {
+    RTCBuildQuality quality = RTC_BUILD_QUALITY_MEDIUM;
+    RTCSceneFlags flags = RTC_SCENE_FLAG_NONE;
+
+    BVHBuildParams() = default;
+    BVHBuildParams(const RenderParams &params);
+};
+
+/* Per-triangle record of the attributes needed to shade a hit on the triangle, so
+ * shading a hit touches one or two cache lines instead of gathering from the index, uv
+ * and vertex buffers
+ */
+struct ShadingRecord {
+    glm::vec2 uvs[3];
+    // Object space edges from the first vertex to the second and third
+    glm::vec3 edge_ab, edge_ac;
+};
+static_assert(sizeof(ShadingRecord) == 48, "ShadingRecord should be tightly packed");
+
 struct Geometry {
-    // vertex_buf is padded out by an extra vec3 for Embree's alignment requirements
-    // n_vertices = the real # of vertices, ie vertex_buf.size() - 1
+    /* The geometry's buffers are shared with the scene, except for the vertex buffer if
+     * it has no spare capacity to meet Embree's padding requirement. Embree reads the
+     * last vertex with a 16 byte load, so we need at least 4 bytes readable after it.
+     * In that case vertex_buf is a copy of the vertices padded by an extra vec3
+     */
     size_t n_vertices = 0;
     std::vector<glm::vec3> vertex_buf;
+    const glm::vec3 *vertices = nullptr;
+    const glm::uvec3 *indices = nullptr;
+    size_t n_indices = 0;
+    const glm::vec3 *normals = nullptr;
+    const glm::vec2 *uvs = nullptr;
+
+    /* With compact attributes the geometry doesn't reference the scene. The vertices
+     * and indices are copied and the uvs are quantized to 2x16 bit unorm values over the
+     * geometry's uv bounds: uv = uv_offset + uv_scale * packed_uv / 65535. The vertex
+     * normals aren't used for shading so they're dropped. Since the full precision data is
+     * copied this only saves memory once the scene's geometry is released, as the
+     * geometry streamer does and the application does with -release-scene
+     */
     std::vector<glm::uvec3> index_buf;
-    std::vector<glm::vec3> normal_buf;
-    std::vector<glm::vec2> uv_buf;
+    std::vector<uint32_t> packed_uvs;
+    glm::vec2 uv_offset = glm::vec2(0.f);
+    glm::vec2 uv_scale = glm::vec2(1.f);
+
+    // Optional per-triangle shading records, in addition to the buffers
+    std::vector<ShadingRecord, tbb::cache_aligned_allocator<ShadingRecord>> shading_records;
 
     RTCGeometry geom = 0;
 
     Geometry() = default;
 
+    // The geometry must outlive the Embree geometry, unless compact_attributes is set
     Geometry(RTCDevice &device,
-             const std::vector<glm::vec3> &verts,
-             const std::vector<glm::uvec3> &indices,
-             const std::vector<glm::vec3> &normals,
-             const std::vector<glm::vec2> &uvs);
+             const ::Geometry &geometry,
+             const BVHBuildParams &build_params,
+             const bool compact_attributes,
+             const bool shading_records);
 
     ~Geometry();
 
+    // Bytes of the buffers owned by the geometry, excluding those shared with the scene
+    size_t nbytes() const;
+
     Geometry(const Geometry &) = delete;
     Geometry &operator=(const Geometry &) = delete;
 };
@@ -40,6 +93,11 @@ struct ISPCGeometry {
     const glm::uvec3 *index_buf = nullptr;
     const glm::vec3 *normal_buf = nullptr;
     const glm::vec2 *uv_buf = nullptr;
+    // Compact attributes, see Geometry
+    const uint32_t *packed_uv_buf = nullptr;
+    glm::vec2 uv_offset = glm::vec2(0.f);
+    glm::vec2 uv_scale = glm::vec2(1.f);
+    const ShadingRecord *shading_records = nullptr;
 
     ISPCGeometry() = default;
     ISPCGeometry(const Geometry &geom);
@@ -54,7 +112,9 @@ public:
 
     TriangleMesh() = default;
 
-    TriangleMesh(RTCDevice &device, std::vector<std::shared_ptr<Geometry>> &geometries);
+    TriangleMesh(RTCDevice &device,
+                 std::vector<std::shared_ptr<Geometry>> &geometries,
+                 const BVHBuildParams &build_params);
 
     ~TriangleMesh();
 
@@ -64,9 +124,14 @@ public:
     RTCScene handle();
 };
 
+struct InstanceGroup;
+
 struct Instance {
     RTCGeometry handle = 0;
+    // The instance references either a mesh or an instance group, or neither for the
+    // proxies of streamed meshes (see StreamedInstance)
     std::shared_ptr<TriangleMesh> mesh = nullptr;
+    std::shared_ptr<InstanceGroup> group = nullptr;
     glm::mat4 object_to_world, world_to_object;
     std::vector<uint32_t> material_ids;
 
@@ -77,8 +142,17 @@ struct Instance {
              const glm::mat4 &object_to_world,
              const std::vector<uint32_t> &material_ids);
 
+    Instance(RTCDevice &device,
+             std::shared_ptr<InstanceGroup> &group,
+             const glm::mat4 &object_to_world);
+
     ~Instance();
 
+    /* Swap the instanced mesh for another with the same geometries, e.g. another level
+     * of detail of it. The top level BVH must be committed again afterwards
+     */
+    void set_mesh(const std::shared_ptr<TriangleMesh> &mesh);
+
     Instance(const Instance &) = delete;
     Instance &operator=(const Instance &) = delete;
 };
@@ -86,33 +160,106 @@ struct Instance {
 struct ISPCInstance {
     const ISPCGeometry *geometries = nullptr;
     const float *object_to_world = nullptr;
-    const float *world_to_object = nullptr;
     const uint32_t *material_ids = nullptr;
+    // Column major 3x3 matrix transforming object space normals to world space, and
+    // the NORMAL_XFM_* class of the transform
+    float normal_matrix[9] = {1.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f, 1.f};
+    uint32_t normal_xfm = NORMAL_XFM_IDENTITY;
+    // For instances of a group, the group's instances indexed by the second level instID
+    const ISPCInstance *group_instances = nullptr;
 
     ISPCInstance() = default;
     ISPCInstance(const Instance &instance);
 };
 
+/* A group of mesh instances which is itself instanced in the top level BVH, giving
+ * two levels of instancing
+ */
+struct InstanceGroup {
+    RTCScene handle = 0;
+    std::vector<std::shared_ptr<Instance>> instances;
+    std::vector<ISPCInstance> ispc_instances;
+
+    InstanceGroup() = default;
+    InstanceGroup(RTCDevice &device,
+                  const std::vector<std::shared_ptr<Instance>> &instances,
+                  const BVHBuildParams &build_params);
+    ~InstanceGroup();
+
+    InstanceGroup(const InstanceGroup &) = delete;
+    InstanceGroup &operator=(const InstanceGroup &) = delete;
+};
+
 struct TopLevelBVH {
     RTCScene handle = 0;
     std::vector<std::shared_ptr<Instance>> instances;
     std::vector<ISPCInstance> ispc_instances;
 
     TopLevelBVH() = default;
-    TopLevelBVH(RTCDevice &device, const std::vector<std::shared_ptr<Instance>> &instances);
+    TopLevelBVH(RTCDevice &device,
+                const std::vector<std::shared_ptr<Instance>> &instances,
+                const BVHBuildParams &build_params);
     ~TopLevelBVH();
 
     TopLevelBVH(const TopLevelBVH &) = delete;
     TopLevelBVH &operator=(const TopLevelBVH &) = delete;
 };
 
+struct ISPCMipLevel {
+    int width = -1;
+    int height = -1;
+    const uint8_t *data = nullptr;
+    // Index of the level's first tile in the texture cache, for cached textures
+    uint64_t first_cache_tile = 0;
+
+    ISPCMipLevel() = default;
+    ISPCMipLevel(const Image &img);
+};
+
+class TextureCache;
+
+// Convert the sRGB image's color channels to linear, leaving linear images unchanged
+void linearize_srgb(Image &img);
+
+/* Box filter the image down to the next level of its mip pyramid, for odd sized levels the
+ * last row/column is folded into the last texel
+ */
+Image next_mip_level(const Image &prev);
+
+/* A texture and its mip pyramid, level 0 is the input image. The texels of each
+ * level are stored in the texture's TEXTURE_LAYOUT_* layout, the level's width and
+ * height are the unpadded size of the level
+ */
+struct Texture2D {
+    uint32_t layout = TEXTURE_LAYOUT_LINEAR;
+    std::vector<Image> levels;
+    std::vector<ISPCMipLevel> ispc_levels;
+    // The texture cache the texels are paged in from, for cached textures
+    TextureCache *cache = nullptr;
+
+    Texture2D(Image img, const TextureLayout layout);
+
+    /* Make a texture whose texels are in the texture cache, the levels just give the size
+     * of each mip level and the first of its tiles in the cache
+     */
+    Texture2D(TextureCache *cache,
+              std::vector<Image> cached_levels,
+              const std::vector<uint64_t> &first_cache_tiles);
+
+    Texture2D(const Texture2D &) = delete;
+    Texture2D &operator=(const Texture2D &) = delete;
+};
+
 struct ISPCTexture2D {
     int width = -1;
     int height = -1;
     int channels = -1;
-    const uint8_t *data = nullptr;
+    uint32_t num_levels = 0;
+    uint32_t layout = TEXTURE_LAYOUT_LINEAR;
+    const ISPCMipLevel *levels = nullptr;
+    void *cache = nullptr;
 
-    ISPCTexture2D(const Image &img);
+    ISPCTexture2D(const Texture2D &tex);
     ISPCTexture2D() = default;
 };
 
@@ -134,9 +281,29 @@ struct MaterialParams {
     float specular_transmission = 0;
 };
 
+/* Entry of an alias table, for sampling a discrete distribution in O(1): entry i is
+ * picked uniformly, then i is returned with probability prob or its alias otherwise.
+ * pmf is the probability of sampling i
+ */
+struct AliasEntry {
+    float prob = 1.f;
+    uint32_t alias = 0;
+    float pmf = 0.f;
+};
+
+/* Build an alias table sampling proportionally to the weights, or uniformly if they're
+ * all zero
+ */
+std::vector<AliasEntry> build_alias_table(const std::vector<float> &weights);
+
+// The light's emitted power, up to a constant factor shared by all quad lights
+float light_power(const QuadLight &light);
+
 struct ViewParams {
     glm::vec3 pos, dir_du, dir_dv, dir_top_left;
     uint32_t frame_id;
+    // Spread angle of the ray cone through a pixel, used for texture LOD selection
+    float pixel_spread_angle;
 };
 
 struct SceneContext {
@@ -144,9 +311,56 @@ struct SceneContext {
     ISPCInstance *instances;
     MaterialParams *materials;
     QuadLight *lights;
+    // Alias table for sampling the lights proportionally to their power
+    AliasEntry *light_alias_table;
+    // Light BVH for picking lights by their estimated contribution, if enabled
+    LightBVHNode *light_bvh;
+    // Environment map lighting the scene, if any
+    ISPCEnvironmentMap *environment;
     ISPCTexture2D *textures;
     uint32_t num_lights;
     uint32_t samples_per_pixel;
+    // Resampled direct lighting options, see RenderParams
+    uint32_t ris_candidates;
+    uint32_t ris_temporal_reuse;
+    uint32_t ris_spatial_reuse;
+    // One of the SAMPLER_* types
+    uint32_t sampler;
+    // Radiance cache hash table, if enabled
+    const RadianceCacheCell *radiance_cache;
+    uint32_t radiance_cache_mask;
+    float radiance_cache_cell_size;
+    // Number of diffuse bounces before paths terminate into the cache
+    uint32_t radiance_cache_bounce;
+    // Index of the pixel in each training block which traces the frame's training path
+    uint32_t radiance_cache_training_pixel;
+    // Path guide's spatial tree and its leaves' directional CDFs, if guiding
+    const GuideNode *path_guide;
+    const float *guide_cdfs;
+    // Index of the pixel in each training block which traces the frame's guide training
+    // path
+    uint32_t guide_training_pixel;
+    // Path length and Russian roulette options, see RenderParams
+    uint32_t max_path_depth;
+    uint32_t max_diffuse_depth;
+    uint32_t max_specular_depth;
+    uint32_t roulette_start;
+    uint32_t efficiency_roulette;
+};
+
+/* The light sample resampled for a pixel's primary hit, along with the hit's normal and
+ * depth to check if it's similar enough to reuse the sample at another hit
+ */
+struct Reservoir {
+    glm::vec3 light_pos;
+    uint32_t light_id = 0;
+    glm::vec3 normal;
+    float depth = 0.f;
+    // Number of candidates the sample was resampled from, 0 if the reservoir is empty
+    float num_samples = 0.f;
+    // Unbiased contribution weight of the sample, 0 if it's occluded
+    float weight = 0.f;
+    float pad[2] = {0.f};
 };
 
 struct Tile {
@@ -155,6 +369,15 @@ struct Tile {
     uint32_t fb_width, fb_height;
     float *data;
     uint16_t *ray_stats;
+    // The tile's reservoirs for this frame and the previous one, if resampling
+    Reservoir *reservoirs;
+    const Reservoir *prev_reservoirs;
+    // The tile's accumulated AOVs laid out as in aov_layout.h, if denoising
+    float *aovs;
+    // The tile's radiance cache updates, if the cache is enabled
+    RadianceCacheUpdate *cache_updates;
+    // The tile's path guide training records, if guiding
+    GuideRecord *guide_records;
 };
 
 }
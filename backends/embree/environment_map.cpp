@@ -0,0 +1,60 @@
+#include "environment_map.h"
+#include <cmath>
+#include "util.h"
+#include <glm/ext.hpp>
+
+namespace embree {
+
+// Normalize the CDF over n entries with the total, making it uniform if the total is 0
+static void normalize_cdf(float *cdf, const int n, const double total)
+{
+    for (int i = 1; i <= n; ++i) {
+        cdf[i] = total > 0.0 ? cdf[i] / total : float(i) / n;
+    }
+}
+
+EnvironmentMap::EnvironmentMap(const HDRImage &img)
+    : width(img.width),
+      height(img.height),
+      radiance(img.img),
+      pdf(width * height, 0.f),
+      marginal_cdf(height + 1, 0.f),
+      conditional_cdf(height * (width + 1), 0.f)
+{
+    double total = 0.0;
+    for (int y = 0; y < height; ++y) {
+        const float sin_theta = std::sin(glm::pi<float>() * (y + 0.5f) / height);
+        float *cdf = &conditional_cdf[y * (width + 1)];
+        double row_total = 0.0;
+        for (int x = 0; x < width; ++x) {
+            const float *px = &radiance[(y * width + x) * 3];
+            const float f = luminance(glm::vec3(px[0], px[1], px[2])) * sin_theta;
+            pdf[y * width + x] = f;
+            row_total += f;
+            cdf[x + 1] = row_total;
+        }
+        normalize_cdf(cdf, width, row_total);
+
+        total += row_total;
+        marginal_cdf[y + 1] = total;
+    }
+    normalize_cdf(marginal_cdf.data(), height, total);
+
+    // Normalize the density over the unit square, f / (integral of f over the uvs)
+    const double integral = total / (double(width) * height);
+    for (auto &p : pdf) {
+        p = integral > 0.0 ? p / integral : 1.f;
+    }
+}
+
+ISPCEnvironmentMap::ISPCEnvironmentMap(const EnvironmentMap &env)
+    : radiance(env.radiance.data()),
+      pdf(env.pdf.data()),
+      marginal_cdf(env.marginal_cdf.data()),
+      conditional_cdf(env.conditional_cdf.data()),
+      width(env.width),
+      height(env.height)
+{
+}
+
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+#include "material.h"
+
+namespace embree {
+
+/* Equirectangular environment map with a piecewise constant distribution for sampling
+ * directions proportionally to the map's luminance. The distribution is a marginal
+ * distribution over the rows and a conditional distribution over each row's texels,
+ * weighted by sin(theta) to account for the stretching towards the poles
+ */
+struct EnvironmentMap {
+    int width = 0;
+    int height = 0;
+    // RGB radiance of each texel
+    std::vector<float> radiance;
+    // Density of sampling each texel over the unit square of the map's uvs
+    std::vector<float> pdf;
+    // The height + 1 entry CDF over the rows, and the width + 1 entry CDF of each row
+    std::vector<float> marginal_cdf;
+    std::vector<float> conditional_cdf;
+
+    EnvironmentMap(const HDRImage &img);
+
+    EnvironmentMap(const EnvironmentMap &) = delete;
+    EnvironmentMap &operator=(const EnvironmentMap &) = delete;
+};
+
+struct ISPCEnvironmentMap {
+    const float *radiance = nullptr;
+    const float *pdf = nullptr;
+    const float *marginal_cdf = nullptr;
+    const float *conditional_cdf = nullptr;
+    int width = 0;
+    int height = 0;
+
+    ISPCEnvironmentMap() = default;
+    ISPCEnvironmentMap(const EnvironmentMap &env);
+};
+
+}
@@ -0,0 +1,308 @@
+#include "geometry_streamer.h"
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <tbb/task_arena.h>
+#include <glm/ext.hpp>
+
+namespace embree {
+
+// Compute the world space bounds of the instance's mesh
+static void streamed_instance_bounds(const RTCBoundsFunctionArguments *args)
+{
+    const auto *instance = reinterpret_cast<const StreamedInstance *>(args->geometryUserPtr);
+    glm::vec3 lower(std::numeric_limits<float>::infinity());
+    glm::vec3 upper(-std::numeric_limits<float>::infinity());
+    for (int i = 0; i < 8; ++i) {
+        const glm::vec3 corner(i & 1 ? instance->bounds_max.x : instance->bounds_min.x,
+                               i & 2 ? instance->bounds_max.y : instance->bounds_min.y,
+                               i & 4 ? instance->bounds_max.z : instance->bounds_min.z);
+        const glm::vec3 p = glm::vec3(instance->object_to_world * glm::vec4(corner, 1.f));
+        lower = glm::min(lower, p);
+        upper = glm::max(upper, p);
+    }
+    args->bounds_o->lower_x = lower.x;
+    args->bounds_o->lower_y = lower.y;
+    args->bounds_o->lower_z = lower.z;
+    args->bounds_o->upper_x = upper.x;
+    args->bounds_o->upper_y = upper.y;
+    args->bounds_o->upper_z = upper.z;
+}
+
+/* Transform ray i of the ray packet into the instance's object space. The direction
+ * isn't normalized so the ray's t values are the same in both spaces
+ */
+static RTCRayHit object_space_ray(const StreamedInstance *instance,
+                                  RTCRayN *ray,
+                                  const uint32_t N,
+                                  const uint32_t i)
+{
+    const glm::vec3 org = glm::vec3(
+        instance->world_to_object * glm::vec4(RTCRayN_org_x(ray, N, i),
+                                              RTCRayN_org_y(ray, N, i),
+                                              RTCRayN_org_z(ray, N, i),
+                                              1.f));
+    const glm::vec3 dir = glm::vec3(
+        instance->world_to_object * glm::vec4(RTCRayN_dir_x(ray, N, i),
+                                              RTCRayN_dir_y(ray, N, i),
+                                              RTCRayN_dir_z(ray, N, i),
+                                              0.f));
+
+    RTCRayHit rayhit;
+    rayhit.ray.org_x = org.x;
+    rayhit.ray.org_y = org.y;
+    rayhit.ray.org_z = org.z;
+    rayhit.ray.tnear = RTCRayN_tnear(ray, N, i);
+    rayhit.ray.dir_x = dir.x;
+    rayhit.ray.dir_y = dir.y;
+    rayhit.ray.dir_z = dir.z;
+    rayhit.ray.time = RTCRayN_time(ray, N, i);
+    rayhit.ray.tfar = RTCRayN_tfar(ray, N, i);
+    rayhit.ray.mask = RTCRayN_mask(ray, N, i);
+    rayhit.ray.id = RTCRayN_id(ray, N, i);
+    rayhit.ray.flags = RTCRayN_flags(ray, N, i);
+
+    rayhit.hit.primID = RTC_INVALID_GEOMETRY_ID;
+    rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+    for (uint32_t l = 0; l < RTC_MAX_INSTANCE_LEVEL_COUNT; ++l) {
+        rayhit.hit.instID[l] = RTC_INVALID_GEOMETRY_ID;
+    }
+    return rayhit;
+}
+
+/* Trace the rays against the instance's mesh, reporting hits as if the mesh was
+ * instanced directly: the geometric normal is in object space and instID[0] is the
+ * instance's index in the top level BVH
+ */
+static void streamed_instance_intersect(const RTCIntersectFunctionNArguments *args)
+{
+    const auto *instance = reinterpret_cast<const StreamedInstance *>(args->geometryUserPtr);
+    RTCRayN *ray = RTCRayHitN_RayN(args->rayhit, args->N);
+    RTCHitN *hit = RTCRayHitN_HitN(args->rayhit, args->N);
+    TriangleMesh *mesh = nullptr;
+    for (uint32_t i = 0; i < args->N; ++i) {
+        if (!args->valid[i]) {
+            continue;
+        }
+        if (!mesh) {
+            mesh = instance->streamer->request_mesh(instance->mesh_id);
+        }
+
+        RTCRayHit rayhit = object_space_ray(instance, ray, args->N, i);
+        rtcIntersect1(mesh->handle(), &rayhit);
+        if (rayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
+            continue;
+        }
+
+        RTCRayN_tfar(ray, args->N, i) = rayhit.ray.tfar;
+        RTCHitN_Ng_x(hit, args->N, i) = rayhit.hit.Ng_x;
+        RTCHitN_Ng_y(hit, args->N, i) = rayhit.hit.Ng_y;
+        RTCHitN_Ng_z(hit, args->N, i) = rayhit.hit.Ng_z;
+        RTCHitN_u(hit, args->N, i) = rayhit.hit.u;
+        RTCHitN_v(hit, args->N, i) = rayhit.hit.v;
+        RTCHitN_primID(hit, args->N, i) = rayhit.hit.primID;
+        RTCHitN_geomID(hit, args->N, i) = rayhit.hit.geomID;
+        RTCHitN_instID(hit, args->N, i, 0) = instance->instance_id;
+    }
+}
+
+static void streamed_instance_occluded(const RTCOccludedFunctionNArguments *args)
+{
+    const auto *instance = reinterpret_cast<const StreamedInstance *>(args->geometryUserPtr);
+    TriangleMesh *mesh = nullptr;
+    for (uint32_t i = 0; i < args->N; ++i) {
+        if (!args->valid[i]) {
+            continue;
+        }
+        if (!mesh) {
+            mesh = instance->streamer->request_mesh(instance->mesh_id);
+        }
+
+        RTCRayHit rayhit = object_space_ray(instance, args->ray, args->N, i);
+        rtcOccluded1(mesh->handle(), &rayhit.ray);
+        // Embree marks occluded rays by setting tfar to -inf
+        if (rayhit.ray.tfar < 0.f) {
+            RTCRayN_tfar(args->ray, args->N, i) = rayhit.ray.tfar;
+        }
+    }
+}
+
+StreamedInstance::StreamedInstance(RTCDevice &device,
+                                   GeometryStreamer *streamer,
+                                   const size_t mesh_id,
+                                   const uint32_t instance_id,
+                                   const glm::mat4 &xfm,
+                                   const std::vector<uint32_t> &ids)
+    : streamer(streamer), mesh_id(mesh_id), instance_id(instance_id)
+{
+    handle = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_USER);
+    object_to_world = xfm;
+    world_to_object = glm::inverse(object_to_world);
+    material_ids = ids;
+
+    rtcSetGeometryUserPrimitiveCount(handle, 1);
+    rtcSetGeometryUserData(handle, this);
+    rtcSetGeometryBoundsFunction(handle, streamed_instance_bounds, nullptr);
+    rtcSetGeometryIntersectFunction(handle, streamed_instance_intersect);
+    rtcSetGeometryOccludedFunction(handle, streamed_instance_occluded);
+    rtcCommitGeometry(handle);
+}
+
+GeometryStreamer::GeometryStreamer(RTCDevice &device,
+                                   const std::shared_ptr<const Scene> &scene,
+                                   const BVHBuildParams &build_params)
+    : device(device),
+      scene(scene),
+      build_params(build_params),
+      frame(0),
+      warned_over_budget(false),
+      resident_bytes(0),
+      loads(0),
+      evictions(0)
+{
+    for (size_t i = 0; i < scene->streamed_meshes.size(); ++i) {
+        meshes.push_back(std::make_unique<MeshEntry>());
+    }
+}
+
+std::vector<std::shared_ptr<Instance>> GeometryStreamer::make_instances()
+{
+    std::vector<std::shared_ptr<Instance>> instances;
+    for (size_t i = 0; i < scene->instances.size(); ++i) {
+        const auto &inst = scene->instances[i];
+        const auto &pm = scene->parameterized_meshes[inst.parameterized_mesh_id];
+        const StreamedMesh &mesh = scene->streamed_meshes[pm.mesh_id];
+        auto instance = std::make_shared<StreamedInstance>(
+            device, this, pm.mesh_id, i, inst.transform, pm.material_ids);
+        instance->bounds_min = mesh.bounds_min;
+        instance->bounds_max = mesh.bounds_max;
+        instances.push_back(instance);
+
+        meshes[pm.mesh_id]->instances.push_back(i);
+    }
+    return instances;
+}
+
+void GeometryStreamer::set_ispc_instances(ISPCInstance *instances)
+{
+    ispc_instances = instances;
+}
+
+TriangleMesh *GeometryStreamer::request_mesh(const size_t mesh_id)
+{
+    MeshEntry &entry = *meshes[mesh_id];
+    // The frame must be stored before reading the resident mesh, evict clears the
+    // resident mesh before checking the frame so one of us sees the other's store
+    entry.last_used_frame = frame.load();
+    TriangleMesh *mesh = entry.resident.load();
+    if (mesh) {
+        return mesh;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(entry.mutex);
+        if (entry.mesh) {
+            entry.resident = entry.mesh.get();
+            return entry.mesh.get();
+        }
+
+        // Isolate the build so this thread doesn't pick up other render tasks while
+        // waiting on it, which could request this mesh again while we hold its lock
+        const bool compact_attributes = scene->render_params.compact_attributes;
+        const bool shading_records = scene->render_params.shading_records;
+        tbb::this_task_arena::isolate([&]() {
+            entry.data = std::make_unique<::Mesh>(scene->streamed_meshes[mesh_id].load());
+            std::vector<std::shared_ptr<Geometry>> geometries;
+            for (const auto &geom : entry.data->geometries) {
+                geometries.push_back(std::make_shared<Geometry>(
+                    device, geom, build_params, compact_attributes, shading_records));
+            }
+            entry.mesh = std::make_shared<TriangleMesh>(device, geometries, build_params);
+        });
+        entry.bytes = 0;
+        for (const auto &g : entry.mesh->geometries) {
+            entry.bytes += g->nbytes();
+        }
+        if (compact_attributes) {
+            entry.data = nullptr;
+        } else {
+            entry.bytes += scene->streamed_meshes[mesh_id].nbytes();
+        }
+        resident_bytes += entry.bytes;
+        ++loads;
+
+        for (const auto &i : entry.instances) {
+            ispc_instances[i].geometries = entry.mesh->ispc_geometries.data();
+        }
+        mesh = entry.mesh.get();
+        entry.resident = mesh;
+    }
+
+    if (resident_bytes > scene->render_params.geometry_budget) {
+        evict(frame.load());
+    }
+    return mesh;
+}
+
+void GeometryStreamer::evict(const uint32_t min_frame)
+{
+    std::unique_lock<std::mutex> evict_lock(evict_mutex, std::try_to_lock);
+    if (!evict_lock) {
+        return;
+    }
+
+    const size_t budget = scene->render_params.geometry_budget;
+    std::vector<MeshEntry *> candidates;
+    for (auto &m : meshes) {
+        if (m->resident.load() && m->last_used_frame.load() < min_frame) {
+            candidates.push_back(m.get());
+        }
+    }
+    std::sort(candidates.begin(),
+              candidates.end(),
+              [](const MeshEntry *a, const MeshEntry *b) {
+                  return a->last_used_frame < b->last_used_frame;
+              });
+
+    for (auto *m : candidates) {
+        if (resident_bytes <= budget) {
+            break;
+        }
+        // Don't wait on a mesh another thread is loading, it's being used
+        std::unique_lock<std::mutex> lock(m->mutex, std::try_to_lock);
+        if (!lock || !m->mesh) {
+            continue;
+        }
+        // Hide the mesh from new requests, then check no ray requested it this frame
+        // before we did. Otherwise it's in use, so put it back
+        m->resident = nullptr;
+        if (m->last_used_frame.load() >= min_frame) {
+            m->resident = m->mesh.get();
+            continue;
+        }
+
+        for (const auto &i : m->instances) {
+            ispc_instances[i].geometries = nullptr;
+        }
+        m->mesh = nullptr;
+        m->data = nullptr;
+        resident_bytes -= m->bytes;
+        m->bytes = 0;
+        ++evictions;
+    }
+
+    if (resident_bytes > budget && !warned_over_budget.exchange(true)) {
+        std::cerr << "Warning: The meshes used by the frame exceed the out-of-core budget, "
+                     "they'll be evicted once the frame is done\n";
+    }
+}
+
+void GeometryStreamer::end_frame()
+{
+    // No rays are in flight between frames, so any mesh not used by the next frame can
+    // be evicted
+    ++frame;
+    evict(frame.load());
+}
+
+}
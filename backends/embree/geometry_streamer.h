@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <embree4/rtcore.h>
+#include "embree_utils.h"
+#include "scene.h"
+
+namespace embree {
+
+class GeometryStreamer;
+
+/* An instance of a streamed mesh, placed in the top level BVH as a user geometry proxy
+ * over the instance's bounds. Rays hitting the bounds load the mesh through the
+ * streamer and are traced against its BVH in the instance's object space
+ */
+struct StreamedInstance : Instance {
+    GeometryStreamer *streamer = nullptr;
+    size_t mesh_id = 0;
+    uint32_t instance_id = 0;
+    glm::vec3 bounds_min, bounds_max;
+
+    StreamedInstance(RTCDevice &device,
+                     GeometryStreamer *streamer,
+                     const size_t mesh_id,
+                     const uint32_t instance_id,
+                     const glm::mat4 &object_to_world,
+                     const std::vector<uint32_t> &material_ids);
+};
+
+/* Loads the meshes of an out-of-core scene on demand. The first ray to hit an instance
+ * of a mesh loads it from the scene's file mapping and builds its BVH. When a load puts
+ * the resident mesh data over the budget, meshes not used in the current frame are
+ * evicted in least recently used order. Meshes used by the current frame can't be
+ * evicted until it ends, so a frame which uses more mesh data than the budget goes over
+ * it until end_frame, with a warning
+ */
+class GeometryStreamer {
+    struct MeshEntry {
+        std::mutex mutex;
+        // The mesh data copied out of the scene file, shared with the Embree geometries
+        // unless using compact attributes
+        std::unique_ptr<::Mesh> data;
+        std::shared_ptr<TriangleMesh> mesh;
+        // Set once the mesh is loaded, to check if it's resident without taking the lock
+        std::atomic<TriangleMesh *> resident{nullptr};
+        std::atomic<uint32_t> last_used_frame{0};
+        // Bytes of mesh data held by the entry, the copy of the scene data if it's kept
+        // and the buffers owned by the Embree geometries
+        size_t bytes = 0;
+        // The instances of the mesh, whose ISPC instances reference its geometries
+        std::vector<uint32_t> instances;
+    };
+
+    RTCDevice device;
+    std::shared_ptr<const Scene> scene;
+    BVHBuildParams build_params;
+    std::vector<std::unique_ptr<MeshEntry>> meshes;
+    ISPCInstance *ispc_instances = nullptr;
+    std::atomic<uint32_t> frame;
+    // Taken by the thread evicting meshes, other threads skip evicting while it's held
+    std::mutex evict_mutex;
+    std::atomic<bool> warned_over_budget;
+
+    /* Evict meshes in least recently used order until the resident mesh data is within
+     * the budget. Meshes used since min_frame are kept, and meshes whose lock is held
+     * by another thread are skipped
+     */
+    void evict(const uint32_t min_frame);
+
+public:
+    std::atomic<size_t> resident_bytes;
+    std::atomic<uint64_t> loads;
+    std::atomic<uint64_t> evictions;
+
+    GeometryStreamer(RTCDevice &device,
+                     const std::shared_ptr<const Scene> &scene,
+                     const BVHBuildParams &build_params);
+
+    GeometryStreamer(const GeometryStreamer &) = delete;
+    GeometryStreamer &operator=(const GeometryStreamer &) = delete;
+
+    // Make the proxy instances for the scene's instances
+    std::vector<std::shared_ptr<Instance>> make_instances();
+
+    // Set the ISPC instances of the top level BVH built over the proxy instances
+    void set_ispc_instances(ISPCInstance *instances);
+
+    /* Get the mesh, loading it if it's not resident. Called from the ray traversal
+     * callbacks so it's safe to call from multiple threads
+     */
+    TriangleMesh *request_mesh(const size_t mesh_id);
+
+    /* Evict least recently used meshes until the resident mesh data is within the
+     * budget and start the next frame, must be called between frames while no rays are
+     * being traced
+     */
+    void end_frame();
+};
+
+}
@@ -0,0 +1,152 @@
+#include "light_bvh.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "embree_utils.h"
+#include <glm/ext.hpp>
+
+namespace embree {
+
+struct LightCone {
+    glm::vec3 axis = glm::vec3(0.f, 0.f, 1.f);
+    float theta_o = 0.f;
+};
+
+// Find the smallest cone containing both cones, see Conty Estevez and Kulla 2018
+static LightCone merge_cones(LightCone a, LightCone b)
+{
+    if (b.theta_o > a.theta_o) {
+        std::swap(a, b);
+    }
+    const float theta_d = std::acos(glm::clamp(glm::dot(a.axis, b.axis), -1.f, 1.f));
+    if (std::min(theta_d + b.theta_o, glm::pi<float>()) <= a.theta_o) {
+        return a;
+    }
+
+    LightCone merged;
+    merged.theta_o = 0.5f * (a.theta_o + theta_d + b.theta_o);
+    if (merged.theta_o >= glm::pi<float>()) {
+        merged.axis = a.axis;
+        merged.theta_o = glm::pi<float>();
+        return merged;
+    }
+    // Rotate a's axis towards b's to center the merged cone
+    const float theta_r = merged.theta_o - a.theta_o;
+    const glm::vec3 ortho = b.axis - glm::dot(a.axis, b.axis) * a.axis;
+    if (glm::length(ortho) == 0.f) {
+        merged.axis = a.axis;
+    } else {
+        merged.axis = glm::normalize(std::cos(theta_r) * a.axis +
+                                     std::sin(theta_r) * glm::normalize(ortho));
+    }
+    return merged;
+}
+
+struct LightBuildInfo {
+    uint32_t light_id;
+    glm::vec3 bounds_min, bounds_max, centroid, normal;
+    float power;
+};
+
+static uint32_t build_node(std::vector<LightBuildInfo> &infos,
+                           const size_t begin,
+                           const size_t end,
+                           std::vector<LightBVHNode> &nodes,
+                           std::vector<LightCone> &cones)
+{
+    const uint32_t node_id = nodes.size();
+    nodes.push_back(LightBVHNode());
+    cones.push_back(LightCone());
+
+    if (end - begin == 1) {
+        const LightBuildInfo &info = infos[begin];
+        LightBVHNode &node = nodes[node_id];
+        node.bounds_min = info.bounds_min;
+        node.bounds_max = info.bounds_max;
+        node.power = info.power;
+        node.child_or_light = info.light_id;
+        node.axis = info.normal;
+        node.cos_theta_o = 1.f;
+        node.is_leaf = 1;
+        cones[node_id].axis = info.normal;
+        return node_id;
+    }
+
+    glm::vec3 centroid_min(std::numeric_limits<float>::infinity());
+    glm::vec3 centroid_max(-std::numeric_limits<float>::infinity());
+    for (size_t i = begin; i < end; ++i) {
+        centroid_min = glm::min(centroid_min, infos[i].centroid);
+        centroid_max = glm::max(centroid_max, infos[i].centroid);
+    }
+    const glm::vec3 extent = centroid_max - centroid_min;
+    int axis = 0;
+    if (extent.y > extent[axis]) {
+        axis = 1;
+    }
+    if (extent.z > extent[axis]) {
+        axis = 2;
+    }
+
+    const size_t mid = begin + (end - begin) / 2;
+    std::nth_element(infos.begin() + begin,
+                     infos.begin() + mid,
+                     infos.begin() + end,
+                     [&](const LightBuildInfo &a, const LightBuildInfo &b) {
+                         return a.centroid[axis] < b.centroid[axis];
+                     });
+
+    const uint32_t left = build_node(infos, begin, mid, nodes, cones);
+    const uint32_t right = build_node(infos, mid, end, nodes, cones);
+
+    // The children may have reallocated the nodes
+    LightBVHNode &node = nodes[node_id];
+    node.bounds_min = glm::min(nodes[left].bounds_min, nodes[right].bounds_min);
+    node.bounds_max = glm::max(nodes[left].bounds_max, nodes[right].bounds_max);
+    node.power = nodes[left].power + nodes[right].power;
+    node.child_or_light = right;
+    cones[node_id] = merge_cones(cones[left], cones[right]);
+    node.axis = cones[node_id].axis;
+    node.cos_theta_o = std::cos(cones[node_id].theta_o);
+    return node_id;
+}
+
+std::vector<LightBVHNode> build_light_bvh(const std::vector<QuadLight> &lights)
+{
+    std::vector<LightBuildInfo> infos;
+    for (size_t i = 0; i < lights.size(); ++i) {
+        const QuadLight &light = lights[i];
+        LightBuildInfo info;
+        info.light_id = i;
+        info.power = light_power(light);
+        if (info.power <= 0.f) {
+            continue;
+        }
+
+        const glm::vec3 p(light.position);
+        const glm::vec3 corners[] = {p,
+                                     p + light.v_x * light.width,
+                                     p + light.v_y * light.height,
+                                     p + light.v_x * light.width + light.v_y * light.height};
+        info.bounds_min = glm::vec3(std::numeric_limits<float>::infinity());
+        info.bounds_max = glm::vec3(-std::numeric_limits<float>::infinity());
+        for (const auto &c : corners) {
+            info.bounds_min = glm::min(info.bounds_min, c);
+            info.bounds_max = glm::max(info.bounds_max, c);
+        }
+        info.centroid = 0.5f * (info.bounds_min + info.bounds_max);
+        info.normal = glm::normalize(glm::vec3(light.normal));
+        infos.push_back(info);
+    }
+
+    std::vector<LightBVHNode> nodes;
+    if (infos.empty()) {
+        return nodes;
+    }
+    nodes.reserve(2 * infos.size() - 1);
+    std::vector<LightCone> cones;
+    cones.reserve(2 * infos.size() - 1);
+    build_node(infos, 0, infos.size(), nodes, cones);
+    return nodes;
+}
+
+}
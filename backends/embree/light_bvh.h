@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "lights.h"
+#include <glm/glm.hpp>
+
+namespace embree {
+
+/* Node of the light BVH, bounding the positions of its lights and the cone of their
+ * normals. Nodes are stored depth first, so an interior node's first child follows it.
+ * Quad lights only emit on their front side, so the cones' emission angle is always
+ * pi/2 and isn't stored
+ */
+struct LightBVHNode {
+    glm::vec3 bounds_min;
+    // Total power of the node's lights
+    float power = 0.f;
+    glm::vec3 bounds_max;
+    // Leaves store their light's index, interior nodes the index of their second child
+    uint32_t child_or_light = 0;
+    glm::vec3 axis;
+    // Cosine of the normal cone's half angle
+    float cos_theta_o = 1.f;
+    uint32_t is_leaf = 0;
+    uint32_t pad[3] = {0};
+};
+static_assert(sizeof(LightBVHNode) == 64, "LightBVHNode should fill a cache line");
+
+/* Build the light BVH over the lights, splitting the lights at the median of the
+ * longest axis of their centroid bounds. Lights with no power are left out
+ */
+std::vector<LightBVHNode> build_light_bvh(const std::vector<QuadLight> &lights);
+
+}
@@ -0,0 +1,16 @@
+// This header is shared between the C++ and ISPC code of the Embree backend
+
+#ifndef EMBREE_NORMAL_TRANSFORM_H
+#define EMBREE_NORMAL_TRANSFORM_H
+
+/* Classes of instance transforms by how they transform normals, so the shading code
+ * can skip work for the common cases
+ */
+// The linear part is a positive uniform scale, normals are unchanged
+#define NORMAL_XFM_IDENTITY 0
+// Rotation and uniform scale, the normal matrix is orthonormal so normals stay normalized
+#define NORMAL_XFM_ORTHONORMAL 1
+// Any other transform, normals must be renormalized after applying the normal matrix
+#define NORMAL_XFM_GENERAL 2
+
+#endif
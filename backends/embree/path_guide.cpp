@@ -0,0 +1,196 @@
+#include "path_guide.h"
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+#include "path_guide_layout.h"
+#include <glm/ext.hpp>
+
+namespace embree {
+
+/* Leaves are split once they gather this many samples over a one frame iteration. The
+ * threshold grows with the square root of the iteration length, so the tree is refined
+ * further as the iterations get longer and gather more samples
+ */
+static const float split_samples = 4000.f;
+static const uint32_t max_depth = 24;
+static const size_t max_leaves = 16384;
+// Once the doubling iterations reach this many frames the guide keeps training in
+// iterations of this length
+static const uint32_t max_iteration_frames = 16;
+
+// Find the directional bin of the direction, matching guide_bin in path_guide.ih
+static uint32_t guide_bin(const glm::vec3 &dir)
+{
+    const float u = glm::clamp((dir.z + 1.f) * 0.5f, 0.f, 1.f);
+    const float v = (std::atan2(dir.y, dir.x) + glm::pi<float>()) / glm::two_pi<float>();
+    const uint32_t bin_cos_theta =
+        std::min(uint32_t(u * GUIDE_BINS_COS_THETA), uint32_t(GUIDE_BINS_COS_THETA - 1));
+    const uint32_t bin_phi =
+        std::min(uint32_t(v * GUIDE_BINS_PHI), uint32_t(GUIDE_BINS_PHI - 1));
+    return bin_cos_theta * GUIDE_BINS_PHI + bin_phi;
+}
+
+PathGuide::PathGuide(const glm::vec3 &bounds_min, const glm::vec3 &bounds_max)
+    : cdfs(GUIDE_BINS, 0.f)
+{
+    GuideNode root;
+    root.axis = GUIDE_LEAF;
+    nodes.push_back(root);
+
+    Leaf leaf;
+    leaf.bounds_min = bounds_min;
+    leaf.bounds_max = bounds_max;
+    leaf.histogram.resize(GUIDE_BINS, 0.f);
+    leaves.push_back(leaf);
+}
+
+void PathGuide::update(const std::vector<std::vector<GuideRecord>> &tile_records)
+{
+    ++frame;
+
+    std::vector<std::pair<uint32_t, const GuideRecord *>> records;
+    for (const auto &t : tile_records) {
+        for (const auto &r : t) {
+            if (r.radiance > 0.f) {
+                records.emplace_back(0, &r);
+            }
+        }
+    }
+    tbb::parallel_for(size_t(0), records.size(), [&](const size_t i) {
+        records[i].first = find_leaf(records[i].second->pos);
+    });
+
+    // Group the records by leaf so the leaves can be updated in parallel
+    tbb::parallel_sort(records.begin(),
+                       records.end(),
+                       [](const std::pair<uint32_t, const GuideRecord *> &a,
+                          const std::pair<uint32_t, const GuideRecord *> &b) {
+                           return a.first < b.first;
+                       });
+    std::vector<size_t> leaf_starts;
+    for (size_t i = 0; i < records.size(); ++i) {
+        if (i == 0 || records[i].first != records[i - 1].first) {
+            leaf_starts.push_back(i);
+        }
+    }
+    leaf_starts.push_back(records.size());
+
+    tbb::parallel_for(size_t(0), leaf_starts.size() - 1, [&](const size_t i) {
+        Leaf &leaf = leaves[records[leaf_starts[i]].first];
+        for (size_t j = leaf_starts[i]; j < leaf_starts[i + 1]; ++j) {
+            const GuideRecord *r = records[j].second;
+            leaf.histogram[guide_bin(r->dir)] += r->radiance;
+            leaf.num_samples += 1.f;
+        }
+    });
+
+    if (frame == iteration_end) {
+        const uint32_t iteration_frames = iteration_end - iteration_start;
+        end_iteration(iteration_frames);
+        iteration_start = frame;
+        iteration_end = frame + std::min(2 * iteration_frames, max_iteration_frames);
+    }
+}
+
+size_t PathGuide::nbytes() const
+{
+    return nodes.capacity() * sizeof(GuideNode) + cdfs.capacity() * sizeof(float) +
+           leaves.capacity() * (sizeof(Leaf) + GUIDE_BINS * sizeof(float));
+}
+
+uint32_t PathGuide::find_leaf(const glm::vec3 &p) const
+{
+    uint32_t n = 0;
+    while (nodes[n].axis != GUIDE_LEAF) {
+        n = nodes[n].child + (p[nodes[n].axis] < nodes[n].split ? 0 : 1);
+    }
+    return nodes[n].child;
+}
+
+void PathGuide::end_iteration(const uint32_t iteration_frames)
+{
+    // Rebuild the distributions of the leaves which gathered radiance, leaves which
+    // didn't keep sampling their previous distribution
+    tbb::parallel_for(size_t(0), leaves.size(), [&](const size_t i) {
+        Leaf &leaf = leaves[i];
+        float total = 0.f;
+        for (const auto &h : leaf.histogram) {
+            total += h;
+        }
+        if (total > 0.f) {
+            float *cdf = &cdfs[i * GUIDE_BINS];
+            float sum = 0.f;
+            for (size_t b = 0; b < GUIDE_BINS; ++b) {
+                sum += leaf.histogram[b];
+                cdf[b] = sum / total;
+            }
+            cdf[GUIDE_BINS - 1] = 1.f;
+            nodes[leaf.node].has_distribution = 1;
+        }
+        std::fill(leaf.histogram.begin(), leaf.histogram.end(), 0.f);
+    });
+
+    const float threshold = split_samples * std::sqrt(float(iteration_frames));
+    const size_t num_leaves = leaves.size();
+    for (size_t i = 0; i < num_leaves && leaves.size() < max_leaves; ++i) {
+        if (leaves[i].num_samples >= threshold && leaves[i].depth < max_depth) {
+            split_leaf(i);
+        }
+    }
+    for (auto &l : leaves) {
+        l.num_samples = 0.f;
+    }
+}
+
+void PathGuide::split_leaf(const uint32_t leaf_id)
+{
+    const Leaf parent = leaves[leaf_id];
+    const uint32_t has_distribution = nodes[parent.node].has_distribution;
+
+    // Split the longest axis of the leaf's bounds in the middle
+    const glm::vec3 extent = parent.bounds_max - parent.bounds_min;
+    uint32_t axis = 2;
+    if (extent.x >= extent.y && extent.x >= extent.z) {
+        axis = 0;
+    } else if (extent.y >= extent.z) {
+        axis = 1;
+    }
+    const float split = 0.5f * (parent.bounds_min[axis] + parent.bounds_max[axis]);
+
+    const uint32_t child = nodes.size();
+    nodes[parent.node].split = split;
+    nodes[parent.node].axis = axis;
+    nodes[parent.node].child = child;
+    nodes[parent.node].has_distribution = 0;
+
+    // The children start out sampling their parent's distribution, the first child
+    // takes over the parent's leaf
+    const uint32_t right_id = leaves.size();
+    Leaf left = parent;
+    left.bounds_max[axis] = split;
+    left.node = child;
+    left.depth = parent.depth + 1;
+    Leaf right = left;
+    right.bounds_min = parent.bounds_min;
+    right.bounds_min[axis] = split;
+    right.bounds_max = parent.bounds_max;
+    right.node = child + 1;
+
+    GuideNode leaf_node;
+    leaf_node.axis = GUIDE_LEAF;
+    leaf_node.has_distribution = has_distribution;
+    leaf_node.child = leaf_id;
+    nodes.push_back(leaf_node);
+    leaf_node.child = right_id;
+    nodes.push_back(leaf_node);
+
+    leaves[leaf_id] = left;
+    leaves.push_back(right);
+    const std::vector<float> cdf(cdfs.begin() + leaf_id * GUIDE_BINS,
+                                 cdfs.begin() + (leaf_id + 1) * GUIDE_BINS);
+    cdfs.insert(cdfs.end(), cdf.begin(), cdf.end());
+}
+
+}
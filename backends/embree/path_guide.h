@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+namespace embree {
+
+// Node of the path guide's spatial tree
+struct GuideNode {
+    // Position of the split plane along the axis
+    float split = 0.f;
+    // Split axis, or GUIDE_LEAF for leaves
+    uint32_t axis = 0;
+    // Index of the first child, the second follows it, or the leaf's index for leaves
+    uint32_t child = 0;
+    // Set for leaves which have a directional distribution to sample
+    uint32_t has_distribution = 0;
+};
+
+// Radiance arriving at a training path vertex along the direction the path continued in
+struct GuideRecord {
+    glm::vec3 pos = glm::vec3(0.f);
+    // Luminance of the incident radiance divided by the pdf of sampling the direction,
+    // 0 if the record is unused
+    float radiance = 0.f;
+    glm::vec3 dir = glm::vec3(0.f);
+    float pad = 0.f;
+};
+
+/* Online learned path guiding distribution, following Muller et al. 2017, Practical
+ * Path Guiding for Efficient Light-Transport Simulation. A binary tree over the scene
+ * splits space adaptively to where the training paths go, and each leaf learns a
+ * histogram of the incident radiance over the sphere of directions. Training proceeds
+ * in iterations of doubling length, at the end of each the leaves' sampling
+ * distributions are rebuilt from the radiance they gathered and leaves which gathered
+ * enough samples are split
+ */
+struct PathGuide {
+    std::vector<GuideNode> nodes;
+    // The CDF over the directional bins of each leaf, GUIDE_BINS entries per leaf
+    std::vector<float> cdfs;
+    uint32_t frame = 0;
+
+    PathGuide(const glm::vec3 &bounds_min, const glm::vec3 &bounds_max);
+
+    PathGuide(const PathGuide &) = delete;
+    PathGuide &operator=(const PathGuide &) = delete;
+
+    /* Add the frame's training records to the leaves' histograms, ending the training
+     * iteration if it's done. Must be called between frames while no paths are
+     * sampling the guide
+     */
+    void update(const std::vector<std::vector<GuideRecord>> &tile_records);
+
+    size_t nbytes() const;
+
+private:
+    struct Leaf {
+        glm::vec3 bounds_min;
+        glm::vec3 bounds_max;
+        uint32_t node = 0;
+        uint32_t depth = 0;
+        float num_samples = 0.f;
+        // Incident radiance gathered in each bin over the current iteration
+        std::vector<float> histogram;
+    };
+
+    std::vector<Leaf> leaves;
+    uint32_t iteration_start = 0;
+    uint32_t iteration_end = 1;
+
+    uint32_t find_leaf(const glm::vec3 &p) const;
+
+    void end_iteration(const uint32_t iteration_frames);
+
+    void split_leaf(const uint32_t leaf_id);
+};
+
+}
@@ -0,0 +1,27 @@
+// This header is shared between the C++ and ISPC code of the Embree backend
+
+#ifndef EMBREE_PATH_GUIDE_LAYOUT_H
+#define EMBREE_PATH_GUIDE_LAYOUT_H
+
+/* Each leaf of the path guide's spatial tree has a histogram over the sphere of
+ * directions, with bins equal in solid angle from a cylindrical mapping of cos(theta)
+ * and phi about the world z axis
+ */
+#define GUIDE_BINS_COS_THETA 16
+#define GUIDE_BINS_PHI 16
+#define GUIDE_BINS (GUIDE_BINS_COS_THETA * GUIDE_BINS_PHI)
+
+// The axis of leaf nodes in the spatial tree
+#define GUIDE_LEAF 3
+
+// Probability of sampling the guide instead of the BSDF where guiding is available
+#define GUIDE_SAMPLING_PROB 0.5f
+
+/* The guide is trained by one pixel of each GUIDE_TRAINING_STRIDE^2 pixel block, which
+ * records the radiance arriving along the direction the path continued in at each of
+ * its vertices
+ */
+#define GUIDE_TRAINING_STRIDE 4
+#define GUIDE_TRAINING_VERTICES 5
+
+#endif
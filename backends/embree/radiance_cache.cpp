@@ -0,0 +1,99 @@
+#include "radiance_cache.h"
+#include <algorithm>
+#include <iterator>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+#include "radiance_cache_layout.h"
+
+namespace embree {
+
+// Number of frames a cell is kept without being updated
+static const uint32_t max_age = 64;
+// Cells average at most this many samples, so their radiance can follow changes to the
+// lighting
+static const float max_samples = 256.f;
+
+RadianceCache::RadianceCache(const uint32_t log2_size, const float cell_size)
+    : cells(size_t(1) << log2_size), cell_size(cell_size)
+{
+}
+
+uint32_t RadianceCache::mask() const
+{
+    return cells.size() - 1;
+}
+
+void RadianceCache::update(const std::vector<std::vector<RadianceCacheUpdate>> &tile_updates)
+{
+    ++frame;
+
+    std::vector<RadianceCacheUpdate> updates;
+    for (const auto &t : tile_updates) {
+        std::copy_if(t.begin(),
+                     t.end(),
+                     std::back_inserter(updates),
+                     [](const RadianceCacheUpdate &u) { return u.checksum != 0; });
+    }
+
+    // Sort the updates by their cell so each cell is found once, visiting the table in
+    // order to keep the merge cache friendly
+    const uint32_t table_mask = mask();
+    tbb::parallel_sort(updates.begin(),
+                       updates.end(),
+                       [&](const RadianceCacheUpdate &a, const RadianceCacheUpdate &b) {
+                           const uint32_t slot_a = a.hash & table_mask;
+                           const uint32_t slot_b = b.hash & table_mask;
+                           return slot_a < slot_b ||
+                                  (slot_a == slot_b && a.checksum < b.checksum);
+                       });
+
+    for (size_t i = 0; i < updates.size();) {
+        const RadianceCacheUpdate &first = updates[i];
+        glm::vec3 radiance_sum(0.f);
+        float num_updates = 0.f;
+        for (; i < updates.size() && updates[i].checksum == first.checksum &&
+               updates[i].hash == first.hash;
+             ++i) {
+            radiance_sum += updates[i].radiance;
+            num_updates += 1.f;
+        }
+
+        // Find the cell, or an empty slot to insert it in. Cells which don't fit in any
+        // of the slots they can probe are dropped
+        RadianceCacheCell *cell = nullptr;
+        RadianceCacheCell *empty = nullptr;
+        for (uint32_t p = 0; p < RADIANCE_CACHE_PROBES; ++p) {
+            RadianceCacheCell &c = cells[(first.hash + p) & table_mask];
+            if (c.checksum == first.checksum) {
+                cell = &c;
+                break;
+            }
+            if (!empty && c.checksum == 0) {
+                empty = &c;
+            }
+        }
+        if (!cell) {
+            if (!empty) {
+                continue;
+            }
+            cell = empty;
+            *cell = RadianceCacheCell();
+            cell->checksum = first.checksum;
+        }
+
+        const float prev_samples = std::min(cell->num_samples, max_samples);
+        cell->radiance =
+            (cell->radiance * prev_samples + radiance_sum) / (prev_samples + num_updates);
+        cell->num_samples = prev_samples + num_updates;
+        cell->last_update = frame;
+    }
+
+    tbb::parallel_for(size_t(0), cells.size(), [&](const size_t i) {
+        RadianceCacheCell &c = cells[i];
+        if (c.checksum != 0 && frame - c.last_update > max_age) {
+            c = RadianceCacheCell();
+        }
+    });
+}
+
+}
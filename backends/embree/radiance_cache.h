@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+namespace embree {
+
+/* A cell of the radiance cache's hash table, holding the average radiance leaving the
+ * surfaces in a grid cell facing along one of the six axis directions
+ */
+struct RadianceCacheCell {
+    glm::vec3 radiance = glm::vec3(0.f);
+    float num_samples = 0.f;
+    // Hash of the cell's grid position and direction identifying it, 0 if empty
+    uint32_t checksum = 0;
+    uint32_t last_update = 0;
+};
+
+// Radiance leaving a vertex of a training path, recorded in the tile's updates
+struct RadianceCacheUpdate {
+    glm::vec3 radiance = glm::vec3(0.f);
+    // Hash selecting the cell's home slot in the table
+    uint32_t hash = 0;
+    // The cell's checksum, 0 if the update is unused
+    uint32_t checksum = 0;
+};
+
+/* World space radiance cache stored in a hash grid, see Binder et al. 2019, Massively
+ * Parallel Path Space Filtering. The cache is trained each frame from the vertices of
+ * the training paths, and cells are evicted if they go without updates for a while so the
+ * cache follows the camera through the scene
+ */
+struct RadianceCache {
+    std::vector<RadianceCacheCell> cells;
+    float cell_size = 1.f;
+    uint32_t frame = 0;
+
+    // Make a cache with 2^log2_size cells over a grid with the given cell size
+    RadianceCache(const uint32_t log2_size, const float cell_size);
+
+    RadianceCache(const RadianceCache &) = delete;
+    RadianceCache &operator=(const RadianceCache &) = delete;
+
+    // The mask to take a hash modulo the table size
+    uint32_t mask() const;
+
+    /* Merge the frame's updates into the cache and evict stale cells, must be called
+     * between frames while no paths are reading the cache
+     */
+    void update(const std::vector<std::vector<RadianceCacheUpdate>> &tile_updates);
+};
+
+}
@@ -0,0 +1,17 @@
+// This header is shared between the C++ and ISPC code of the Embree backend
+
+#ifndef EMBREE_RADIANCE_CACHE_LAYOUT_H
+#define EMBREE_RADIANCE_CACHE_LAYOUT_H
+
+// Number of cells after a cell's home slot in the hash table to search for it
+#define RADIANCE_CACHE_PROBES 8
+// Cells need this many samples before paths terminate into them
+#define RADIANCE_CACHE_MIN_SAMPLES 4
+/* The cache is trained by one pixel of each RADIANCE_CACHE_TRAINING_STRIDE^2 pixel block,
+ * which traces a full length path and records the radiance leaving each of its vertices
+ */
+#define RADIANCE_CACHE_TRAINING_STRIDE 4
+// Number of vertices each training path records updates for
+#define RADIANCE_CACHE_TRAINING_VERTICES 5
+
+#endif
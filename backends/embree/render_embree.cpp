@@ -11,18 +11,48 @@
 #include <xmmintrin.h>
 #endif
 #include <util.h>
+#include "aov_layout.h"
+#include "path_guide_layout.h"
+#include "radiance_cache_layout.h"
 #include "render_embree_ispc.h"
 #include <glm/ext.hpp>
 
 static std::unique_ptr<tbb::global_control> tbb_thread_config;
 
-RenderEmbree::RenderEmbree()
+static bool embree_memory_monitor(void *user_ptr, const ssize_t bytes, const bool /*post*/)
+{
+    auto *embree_bytes = reinterpret_cast<std::atomic<int64_t> *>(user_ptr);
+    *embree_bytes += bytes;
+    return true;
+}
+
+// Build the bottom level BVH of the scene geometries
+static std::shared_ptr<embree::TriangleMesh> build_mesh(
+    RTCDevice device,
+    const std::vector<::Geometry> &scene_geometries,
+    const embree::BVHBuildParams &build_params,
+    const RenderParams &render_params)
+{
+    std::vector<std::shared_ptr<embree::Geometry>> geometries;
+    for (const auto &geom : scene_geometries) {
+        geometries.push_back(
+            std::make_shared<embree::Geometry>(device,
+                                               geom,
+                                               build_params,
+                                               render_params.compact_attributes,
+                                               render_params.shading_records));
+    }
+    return std::make_shared<embree::TriangleMesh>(device, geometries, build_params);
+}
+
+RenderEmbree::RenderEmbree() : embree_bytes(0), geometry_bytes(0)
 {
 #ifndef __aarch64__
     _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
     _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
 #endif
     device = rtcNewDevice(nullptr);
+    rtcSetDeviceMemoryMonitorFunction(device, embree_memory_monitor, &embree_bytes);
 }
 
 RenderEmbree::~RenderEmbree()
@@ -55,62 +85,238 @@ void RenderEmbree::initialize(const int fb_width, const int fb_height)
 #endif
 }
 
-void RenderEmbree::set_scene(const Scene &scene)
+void RenderEmbree::set_scene(const std::shared_ptr<const Scene> &in_scene)
 {
     frame_id = 0;
 
-    samples_per_pixel = scene.samples_per_pixel;
+    // Release the BVH and its references to the old scene's buffers before we
+    // release the old scene
+    scene_bvh = nullptr;
+    geometry_streamer = nullptr;
+    mesh_lods.clear();
+    instance_lods.clear();
+    geometry_bytes = 0;
+    scene = in_scene;
+
+    samples_per_pixel = scene->samples_per_pixel;
+    lod_threshold = scene->render_params.lod_threshold;
+    ris_candidates = scene->render_params.ris_candidates;
+    ris_temporal_reuse = scene->render_params.ris_temporal_reuse;
+    ris_spatial_reuse = scene->render_params.ris_spatial_reuse;
+    denoise = scene->render_params.denoise;
+    render_aovs = scene->render_params.aovs;
+    max_path_depth = std::max(scene->render_params.max_path_depth, 1u);
+    max_diffuse_depth = scene->render_params.max_diffuse_depth;
+    max_specular_depth = scene->render_params.max_specular_depth;
+    roulette_start = scene->render_params.roulette_start;
+    efficiency_roulette = scene->render_params.roulette == RouletteMode::EFFICIENCY;
+    switch (scene->render_params.sampler) {
+    case SamplerType::SOBOL:
+        sampler = SAMPLER_SOBOL;
+        break;
+    case SamplerType::BLUE_NOISE:
+        sampler = SAMPLER_BLUE_NOISE;
+        break;
+    default:
+        sampler = SAMPLER_LCG;
+        break;
+    }
 
+    using namespace std::chrono;
+    auto elapsed_ms = [](const high_resolution_clock::time_point &start) {
+        return duration_cast<nanoseconds>(high_resolution_clock::now() - start).count() *
+               1.0e-6;
+    };
+
+    const embree::BVHBuildParams build_params(scene->render_params);
+    const int64_t start_bytes = embree_bytes;
+    auto start = high_resolution_clock::now();
     std::vector<std::shared_ptr<embree::TriangleMesh>> meshes;
-    for (const auto &mesh : scene.meshes) {
-        std::vector<std::shared_ptr<embree::Geometry>> geometries;
-        for (const auto &geom : mesh.geometries) {
-            geometries.push_back(std::make_shared<embree::Geometry>(
-                device, geom.vertices, geom.indices, geom.normals, geom.uvs));
+    std::vector<std::shared_ptr<embree::Instance>> instances;
+    std::vector<std::shared_ptr<embree::InstanceGroup>> groups;
+    double bottom_level_time = 0.0;
+    double instance_time = 0.0;
+    if (scene->out_of_core()) {
+        // The bottom level BVHs of out-of-core scenes are built on demand while rendering,
+        // the instances are placed in the top level BVH as proxies over their bounds
+        geometry_streamer =
+            std::make_unique<embree::GeometryStreamer>(device, scene, build_params);
+        instances = geometry_streamer->make_instances();
+        instance_time = elapsed_ms(start);
+    } else {
+        /* Embree parallelizes the build of each BVH internally, but scenes with many small
+         * meshes don't have enough work in each build to keep all the cores busy. So we
+         * build the bottom level BVHs concurrently, starting the largest ones first so a
+         * big mesh isn't left building alone at the end
+         */
+        std::vector<size_t> mesh_build_order(scene->meshes.size());
+        std::iota(mesh_build_order.begin(), mesh_build_order.end(), 0);
+        std::sort(mesh_build_order.begin(), mesh_build_order.end(), [&](size_t a, size_t b) {
+            return scene->meshes[a].num_tris() > scene->meshes[b].num_tris();
+        });
+        meshes.resize(scene->meshes.size());
+        mesh_lods.resize(scene->meshes.size());
+        tbb::parallel_for(
+            size_t(0),
+            mesh_build_order.size(),
+            [&](size_t i) {
+                const size_t mesh_id = mesh_build_order[i];
+                const ::Mesh &mesh = scene->meshes[mesh_id];
+                meshes[mesh_id] =
+                    build_mesh(device, mesh.geometries, build_params, scene->render_params);
+                const uint32_t num_levels = scene->render_params.lod_levels;
+                const float edge_length = num_levels > 0 ? mesh.average_edge_length() : 0.f;
+                if (edge_length == 0.f) {
+                    return;
+                }
+
+                // Only the full mesh is built now, the coarser levels are built when an
+                // instance first selects them
+                MeshLODs &lods = mesh_lods[mesh_id];
+                lods.levels.resize(num_levels + 1);
+                lods.levels[0] = meshes[mesh_id];
+                lods.num_tris.resize(num_levels + 1, 0);
+                lods.num_tris[0] = mesh.num_tris();
+                for (uint32_t l = 0; l <= num_levels; ++l) {
+                    lods.edge_lengths.push_back(edge_length * (1 << l));
+                }
+                lods.bounds_min = glm::vec3(std::numeric_limits<float>::infinity());
+                lods.bounds_max = glm::vec3(-std::numeric_limits<float>::infinity());
+                for (const auto &geom : mesh.geometries) {
+                    for (const auto &v : geom.vertices) {
+                        lods.bounds_min = glm::min(lods.bounds_min, v);
+                        lods.bounds_max = glm::max(lods.bounds_max, v);
+                    }
+                }
+            },
+            tbb::simple_partitioner());
+        bottom_level_time = elapsed_ms(start);
+
+        for (const auto &m : meshes) {
+            for (const auto &g : m->geometries) {
+                geometry_bytes += g->nbytes();
+            }
         }
 
-        meshes.push_back(std::make_shared<embree::TriangleMesh>(device, geometries));
-    }
+        start = high_resolution_clock::now();
+        auto make_instances = [&](const std::vector<::Instance> &scene_instances) {
+            std::vector<std::shared_ptr<embree::Instance>> made(scene_instances.size());
+            tbb::parallel_for(size_t(0), made.size(), [&](size_t i) {
+                const auto &inst = scene_instances[i];
+                const auto &pm = scene->parameterized_meshes[inst.parameterized_mesh_id];
+                made[i] = std::make_shared<embree::Instance>(
+                    device, meshes[pm.mesh_id], inst.transform, pm.material_ids);
+            });
+            return made;
+        };
+        instances = make_instances(scene->instances);
+
+        // Instances of meshes with levels of detail start at the full mesh, their level is
+        // selected when rendering. Instances in groups always use the full mesh
+        for (size_t i = 0; i < scene->instances.size(); ++i) {
+            const auto &inst = scene->instances[i];
+            const auto &pm = scene->parameterized_meshes[inst.parameterized_mesh_id];
+            const size_t mesh_id = pm.mesh_id;
+            const MeshLODs &lods = mesh_lods[mesh_id];
+            if (lods.levels.empty()) {
+                continue;
+            }
+            InstanceLOD lod;
+            lod.instance_id = i;
+            lod.mesh_id = mesh_id;
+            const glm::mat3 linear(inst.transform);
+            lod.scale = std::max(glm::length(linear[0]),
+                                 std::max(glm::length(linear[1]), glm::length(linear[2])));
+            const glm::vec3 center = 0.5f * (lods.bounds_min + lods.bounds_max);
+            lod.center = glm::vec3(inst.transform * glm::vec4(center, 1.f));
+            lod.radius = lod.scale * 0.5f * glm::length(lods.bounds_max - lods.bounds_min);
+            instance_lods.push_back(lod);
+        }
 
-    parameterized_meshes = scene.parameterized_meshes;
+        // Instance groups are built into their own BVH and instanced in the top level BVH
+        // after the regular instances, as a second level of instancing
+        groups.resize(scene->instance_groups.size());
+        tbb::parallel_for(size_t(0), groups.size(), [&](size_t i) {
+            groups[i] = std::make_shared<embree::InstanceGroup>(
+                device, make_instances(scene->instance_groups[i].instances), build_params);
+        });
+        instances.resize(scene->instances.size() + scene->group_instances.size());
+        tbb::parallel_for(size_t(0), scene->group_instances.size(), [&](size_t i) {
+            const auto &inst = scene->group_instances[i];
+            instances[scene->instances.size() + i] = std::make_shared<embree::Instance>(
+                device, groups[inst.group_id], inst.transform);
+        });
+        instance_time = elapsed_ms(start);
+    }
 
-    std::vector<std::shared_ptr<embree::Instance>> instances;
-    for (const auto &inst : scene.instances) {
-        const auto &pm = parameterized_meshes[inst.parameterized_mesh_id];
-        instances.push_back(std::make_shared<embree::Instance>(
-            device, meshes[pm.mesh_id], inst.transform, pm.material_ids));
+    start = high_resolution_clock::now();
+    scene_bvh = std::make_shared<embree::TopLevelBVH>(device, instances, build_params);
+    const double top_level_time = elapsed_ms(start);
+    if (geometry_streamer) {
+        geometry_streamer->set_ispc_instances(scene_bvh->ispc_instances.data());
     }
 
-    scene_bvh = std::make_shared<embree::TopLevelBVH>(device, instances);
+    bvh_build_time = bottom_level_time + instance_time + top_level_time;
+    bvh_bytes = embree_bytes - start_bytes;
 
-    textures = scene.textures;
+    if (!instance_lods.empty()) {
+        std::cout << "Embree LOD: " << instance_lods.size()
+                  << " instances with levels of detail\n";
+    }
+    std::cout << "Embree BVH build: " << meshes.size() << " bottom level BVHs in "
+              << bottom_level_time << "ms, " << instances.size() << " instances in "
+              << instance_time << "ms (" << groups.size()
+              << " instance groups), top level BVH in " << top_level_time << "ms\n"
+              << "Embree BVH memory: " << pretty_print_count(bvh_bytes) << "B\n";
+
+    start = high_resolution_clock::now();
+
+    // The old cache must be released first since the new one reopens its backing file
+    texture_cache = nullptr;
+    if (scene->render_params.texture_cache_budget > 0) {
+        texture_cache =
+            std::make_unique<embree::TextureCache>(scene->render_params.texture_cache_file,
+                                                   scene->render_params.texture_cache_budget);
+        if (scene->render_params.texture_layout != TextureLayout::LINEAR) {
+            std::cout << "Warning: The texture cache stores linear RGBA8 tiles, ignoring the "
+                         "tiled/compressed texture layout\n";
+        }
+    }
 
     // Linearize any sRGB textures beforehand, since we don't have fancy sRGB texture
-    // interpolation support in hardware
+    // interpolation support in hardware, then build the mip pyramids from the linear data.
+    // Cached textures are decoded, linearized and have their mips built by the cache
+    textures.resize(scene->textures.size());
     tbb::parallel_for(size_t(0), textures.size(), [&](size_t i) {
-        auto &img = textures[i];
-        if (img.color_space == LINEAR) {
+        if (texture_cache) {
+            textures[i] = texture_cache->add_texture(scene->textures[i]);
             return;
         }
-        img.color_space = LINEAR;
-        const int convert_channels = std::min(3, img.channels);
-        tbb::parallel_for(size_t(0), size_t(img.width) * img.height, [&](size_t px) {
-            for (int c = 0; c < convert_channels; ++c) {
-                float x = img.img[px * img.channels + c] / 255.f;
-                x = srgb_to_linear(x);
-                img.img[px * img.channels + c] = glm::clamp(x * 255.f, 0.f, 255.f);
-            }
-        });
+        Image img = scene->textures[i];
+        embree::linearize_srgb(img);
+        textures[i] = std::make_shared<embree::Texture2D>(std::move(img),
+                                                          scene->render_params.texture_layout);
     });
+    if (texture_cache) {
+        texture_cache->finalize();
+        std::cout << "Embree texture cache: reused " << texture_cache->reused_textures
+                  << " of " << textures.size() << " textures from "
+                  << scene->render_params.texture_cache_file << "\n";
+    }
+    std::cout << "Embree texture upload: " << textures.size() << " textures in "
+              << elapsed_ms(start) << "ms\n";
 
+    ispc_textures.clear();
     ispc_textures.reserve(textures.size());
     std::transform(textures.begin(),
                    textures.end(),
                    std::back_inserter(ispc_textures),
-                   [](const Image &img) { return embree::ISPCTexture2D(img); });
+                   [](const std::shared_ptr<embree::Texture2D> &tex) {
+                       return embree::ISPCTexture2D(*tex);
+                   });
 
-    material_params.reserve(scene.materials.size());
-    for (const auto &m : scene.materials) {
+    material_params.reserve(scene->materials.size());
+    for (const auto &m : scene->materials) {
         embree::MaterialParams p;
 
         p.base_color = m.base_color;
@@ -129,7 +335,210 @@ void RenderEmbree::set_scene(const Scene &scene)
         material_params.push_back(p);
     }
 
-    lights = scene.lights;
+    lights = scene->lights;
+    std::vector<float> light_powers;
+    std::transform(lights.begin(),
+                   lights.end(),
+                   std::back_inserter(light_powers),
+                   [](const QuadLight &l) { return embree::light_power(l); });
+    light_alias_table = embree::build_alias_table(light_powers);
+    light_bvh.clear();
+    if (scene->render_params.light_sampling == LightSampling::BVH) {
+        light_bvh = embree::build_light_bvh(lights);
+    }
+
+    environment = nullptr;
+    if (!scene->environment.img.empty()) {
+        environment = std::make_unique<embree::EnvironmentMap>(scene->environment);
+        ispc_environment = embree::ISPCEnvironmentMap(*environment);
+    }
+
+    radiance_cache = nullptr;
+    cache_updates.clear();
+    if (scene->render_params.radiance_cache) {
+        RTCBounds bounds;
+        rtcGetSceneBounds(scene_bvh->handle, &bounds);
+        const glm::vec3 diagonal(bounds.upper_x - bounds.lower_x,
+                                 bounds.upper_y - bounds.lower_y,
+                                 bounds.upper_z - bounds.lower_z);
+        const float cell_size = glm::length(diagonal) /
+                                std::max(scene->render_params.radiance_cache_resolution, 1u);
+        // 2^20 cells, 24MB
+        radiance_cache = std::make_unique<embree::RadianceCache>(20, cell_size);
+        radiance_cache_bounce =
+            glm::clamp(scene->render_params.radiance_cache_bounce, 1u, 2u);
+    }
+
+    path_guide = nullptr;
+    guide_records.clear();
+    if (scene->render_params.path_guiding) {
+        RTCBounds bounds;
+        rtcGetSceneBounds(scene_bvh->handle, &bounds);
+        path_guide = std::make_unique<embree::PathGuide>(
+            glm::vec3(bounds.lower_x, bounds.lower_y, bounds.lower_z),
+            glm::vec3(bounds.upper_x, bounds.upper_y, bounds.upper_z));
+    }
+
+    // With compact attributes the Embree data doesn't reference the scene, so we can
+    // release it unless we'll build levels of detail from it later
+    if (scene->render_params.compact_attributes && instance_lods.empty()) {
+        scene = nullptr;
+    }
+}
+
+void RenderEmbree::take_scene(std::shared_ptr<Scene> in_scene)
+{
+    set_scene(in_scene);
+    // The materials, textures and lights have been copied and we only reference the
+    // scene's geometry, so release the rest now that the scene is ours
+    in_scene->release_shading_data();
+}
+
+void RenderEmbree::update_scene(const Scene &scene)
+{
+    samples_per_pixel = scene.samples_per_pixel;
+}
+
+bool RenderEmbree::supports_out_of_core()
+{
+    return true;
+}
+
+bool RenderEmbree::supports_lod()
+{
+    return true;
+}
+
+bool RenderEmbree::supports_aovs()
+{
+    return true;
+}
+
+bool RenderEmbree::supports_texture_cache()
+{
+    return true;
+}
+
+
+std::vector<ImageLayer> RenderEmbree::read_aovs()
+{
+    const std::vector<std::string> rgb = {"R", "G", "B"};
+    std::vector<ImageLayer> layers = {ImageLayer{"", rgb, {}},
+                                      ImageLayer{"direct", rgb, {}},
+                                      ImageLayer{"indirect", rgb, {}},
+                                      ImageLayer{"albedo", rgb, {}},
+                                      ImageLayer{"normal", {"X", "Y", "Z"}, {}},
+                                      ImageLayer{"depth", {"Z"}, {}},
+                                      ImageLayer{"id", {"instance", "material"}, {}},
+                                      ImageLayer{"samples", {"count"}, {}}};
+    // Offset of each layer's channels in the AOVs, the color is read from the tiles
+    const int aov_offsets[] = {-1,
+                               AOV_DIRECT,
+                               AOV_INDIRECT,
+                               AOV_ALBEDO,
+                               AOV_NORMAL,
+                               AOV_DEPTH,
+                               AOV_INSTANCE_ID,
+                               AOV_SAMPLE_COUNT};
+    const size_t num_pixels = size_t(fb_dims.x) * fb_dims.y;
+    for (auto &l : layers) {
+        l.data.resize(num_pixels * l.channels.size(), 0.f);
+    }
+    if (aovs.size() != tiles.size()) {
+        return layers;
+    }
+
+    const glm::uvec2 ntiles(fb_dims.x / tile_size.x + (fb_dims.x % tile_size.x != 0 ? 1 : 0),
+                            fb_dims.y / tile_size.y + (fb_dims.y % tile_size.y != 0 ? 1 : 0));
+    tbb::parallel_for(uint32_t(0), ntiles.x * ntiles.y, [&](uint32_t tile_id) {
+        const embree::Tile tile = make_ispc_tile(tile_id, ntiles);
+        for (uint32_t j = 0; j < tile.height; ++j) {
+            for (uint32_t i = 0; i < tile.width; ++i) {
+                const size_t tile_px = j * tile.width + i;
+                const size_t fb_px = (j + tile.y) * size_t(fb_dims.x) + i + tile.x;
+                for (size_t l = 0; l < layers.size(); ++l) {
+                    const size_t num_channels = layers[l].channels.size();
+                    const float *src =
+                        aov_offsets[l] < 0
+                            ? &tiles[tile_id][tile_px * 3]
+                            : &aovs[tile_id][tile_px * AOV_STRIDE + aov_offsets[l]];
+                    std::copy(src, src + num_channels, &layers[l].data[fb_px * num_channels]);
+                }
+            }
+        }
+    });
+    return layers;
+}
+
+void RenderEmbree::memory_report(MemoryReport &report)
+{
+    RenderBackend::memory_report(report);
+
+    size_t tile_bytes = 0;
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        tile_bytes += tiles[i].capacity() * sizeof(float) +
+                      ray_stats[i].capacity() * sizeof(uint16_t);
+    }
+    for (size_t i = 0; i < reservoirs.size(); ++i) {
+        tile_bytes += (reservoirs[i].capacity() + prev_reservoirs[i].capacity()) *
+                      sizeof(embree::Reservoir);
+    }
+    report.add("embree/tiles", tile_bytes);
+
+    size_t aov_bytes = 0;
+    for (const auto &a : aovs) {
+        aov_bytes += a.capacity() * sizeof(float);
+    }
+    report.add("embree/aovs", aov_bytes);
+    size_t cache_bytes = 0;
+    if (radiance_cache) {
+        cache_bytes += radiance_cache->cells.capacity() * sizeof(embree::RadianceCacheCell);
+    }
+    for (const auto &u : cache_updates) {
+        cache_bytes += u.capacity() * sizeof(embree::RadianceCacheUpdate);
+    }
+    report.add("embree/radiance_cache", cache_bytes);
+    size_t guide_bytes = path_guide ? path_guide->nbytes() : 0;
+    for (const auto &r : guide_records) {
+        guide_bytes += r.capacity() * sizeof(embree::GuideRecord);
+    }
+    report.add("embree/path_guide", guide_bytes);
+    report.add("embree/denoiser",
+               (denoise_features.capacity() + denoise_irradiance[0].capacity() +
+                denoise_irradiance[1].capacity()) *
+                   sizeof(float));
+
+    // Everything Embree allocates goes through the device memory monitor, which is
+    // mostly the BVHs
+    report.add("embree/bvh", std::max(embree_bytes.load(), int64_t(0)));
+    report.add("embree/geometry", geometry_bytes);
+    if (geometry_streamer) {
+        report.add("embree/streamed meshes", geometry_streamer->resident_bytes);
+    }
+
+    size_t texture_bytes = 0;
+    for (const auto &t : textures) {
+        for (const auto &l : t->levels) {
+            texture_bytes += l.img.capacity();
+        }
+    }
+    report.add("embree/textures", texture_bytes);
+    if (environment) {
+        report.add("embree/environment",
+                   (environment->radiance.capacity() + environment->pdf.capacity() +
+                    environment->marginal_cdf.capacity() +
+                    environment->conditional_cdf.capacity()) *
+                       sizeof(float));
+    }
+    if (texture_cache) {
+        report.add("embree/texture cache", texture_cache->resident_bytes());
+    }
+}
+
+bool RenderEmbree::supports_instance_groups()
+{
+    // Embree must be built with support for more than one level of instancing
+    return RTC_MAX_INSTANCE_LEVEL_COUNT > 1;
 }
 
 RenderStats RenderEmbree::render(const glm::vec3 &pos,
@@ -157,6 +566,12 @@ RenderStats RenderEmbree::render(const glm::vec3 &pos,
         -glm::normalize(glm::cross(view_params.dir_du, dir)) * img_plane_size.y;
     view_params.dir_top_left = dir - 0.5f * view_params.dir_du - 0.5f * view_params.dir_dv;
     view_params.frame_id = frame_id;
+    view_params.pixel_spread_angle = std::atan(img_plane_size.y / fb_dims.y);
+
+    // The levels only depend on the camera, so are selected when it moves
+    if (!instance_lods.empty() && (camera_changed || frame_id == 0)) {
+        select_lods(pos, view_params.pixel_spread_angle);
+    }
 
     embree::SceneContext ispc_scene;
     ispc_scene.scene = scene_bvh->handle;
@@ -164,36 +579,106 @@ RenderStats RenderEmbree::render(const glm::vec3 &pos,
     ispc_scene.materials = material_params.data();
     ispc_scene.textures = ispc_textures.data();
     ispc_scene.lights = lights.data();
+    ispc_scene.light_alias_table = light_alias_table.data();
+    ispc_scene.light_bvh = light_bvh.empty() ? nullptr : light_bvh.data();
+    ispc_scene.environment = environment ? &ispc_environment : nullptr;
     ispc_scene.num_lights = lights.size();
     ispc_scene.samples_per_pixel = samples_per_pixel;
+    ispc_scene.ris_candidates = ris_candidates;
+    ispc_scene.ris_temporal_reuse = ris_temporal_reuse;
+    ispc_scene.ris_spatial_reuse = ris_spatial_reuse;
+    ispc_scene.sampler = sampler;
+    ispc_scene.max_path_depth = max_path_depth;
+    ispc_scene.max_diffuse_depth = max_diffuse_depth;
+    ispc_scene.max_specular_depth = max_specular_depth;
+    ispc_scene.roulette_start = roulette_start;
+    ispc_scene.efficiency_roulette = efficiency_roulette;
+    ispc_scene.radiance_cache = nullptr;
+    if (radiance_cache) {
+        const uint32_t training_pixels =
+            RADIANCE_CACHE_TRAINING_STRIDE * RADIANCE_CACHE_TRAINING_STRIDE;
+        ispc_scene.radiance_cache = radiance_cache->cells.data();
+        ispc_scene.radiance_cache_mask = radiance_cache->mask();
+        ispc_scene.radiance_cache_cell_size = radiance_cache->cell_size;
+        ispc_scene.radiance_cache_bounce = radiance_cache_bounce;
+        // Step through the pixels of each block over the frames so the whole image
+        // trains the cache, 7 is coprime with the block size so all are visited
+        ispc_scene.radiance_cache_training_pixel =
+            (radiance_cache->frame * 7) % training_pixels;
+    }
+    ispc_scene.path_guide = nullptr;
+    ispc_scene.guide_cdfs = nullptr;
+    if (path_guide) {
+        const uint32_t training_pixels = GUIDE_TRAINING_STRIDE * GUIDE_TRAINING_STRIDE;
+        ispc_scene.path_guide = path_guide->nodes.data();
+        ispc_scene.guide_cdfs = path_guide->cdfs.data();
+        ispc_scene.guide_training_pixel = (path_guide->frame * 7) % training_pixels;
+    }
 
     // Round up the number of tiles we need to run in case the
     // framebuffer is not an even multiple of tile size
     const glm::uvec2 ntiles(fb_dims.x / tile_size.x + (fb_dims.x % tile_size.x != 0 ? 1 : 0),
                             fb_dims.y / tile_size.y + (fb_dims.y % tile_size.y != 0 ? 1 : 0));
 
+    // The reservoirs are allocated on first use, or if the framebuffer was resized
+    if (ris_candidates > 0 && reservoirs.size() != tiles.size()) {
+        const std::vector<embree::Reservoir> tile_reservoirs(tile_size.x * tile_size.y);
+        reservoirs.assign(tiles.size(), tile_reservoirs);
+        prev_reservoirs.assign(tiles.size(), tile_reservoirs);
+    }
+    if (radiance_cache && cache_updates.size() != tiles.size()) {
+        const uint32_t blocks = (tile_size.x + RADIANCE_CACHE_TRAINING_STRIDE - 1) /
+                                RADIANCE_CACHE_TRAINING_STRIDE *
+                                ((tile_size.y + RADIANCE_CACHE_TRAINING_STRIDE - 1) /
+                                 RADIANCE_CACHE_TRAINING_STRIDE);
+        cache_updates.assign(tiles.size(),
+                             std::vector<embree::RadianceCacheUpdate>(
+                                 blocks * RADIANCE_CACHE_TRAINING_VERTICES));
+    }
+    if (path_guide && guide_records.size() != tiles.size()) {
+        const uint32_t blocks =
+            (tile_size.x + GUIDE_TRAINING_STRIDE - 1) / GUIDE_TRAINING_STRIDE *
+            ((tile_size.y + GUIDE_TRAINING_STRIDE - 1) / GUIDE_TRAINING_STRIDE);
+        guide_records.assign(
+            tiles.size(),
+            std::vector<embree::GuideRecord>(blocks * GUIDE_TRAINING_VERTICES));
+    }
+    if ((denoise || render_aovs) && aovs.size() != tiles.size()) {
+        aovs.assign(tiles.size(), std::vector<float>(tile_size.x * tile_size.y * AOV_STRIDE));
+    }
+    // Reservoirs from before the camera moved are for other hits, so aren't reused
+    const bool reuse_reservoirs =
+        ris_candidates > 0 && frame_id > 0 && (ris_temporal_reuse || ris_spatial_reuse);
+
     uint8_t *color = reinterpret_cast<uint8_t *>(img.data());
 
     auto start = high_resolution_clock::now();
     tbb::parallel_for(uint32_t(0), ntiles.x * ntiles.y, [&](uint32_t tile_id) {
-        const glm::uvec2 tile = glm::uvec2(tile_id % ntiles.x, tile_id / ntiles.x);
-        const glm::uvec2 tile_pos = tile * tile_size;
-        const glm::uvec2 tile_end = glm::min(tile_pos + tile_size, fb_dims);
-        const glm::uvec2 actual_tile_dims = tile_end - tile_pos;
-
-        embree::Tile ispc_tile;
-        ispc_tile.x = tile_pos.x;
-        ispc_tile.y = tile_pos.y;
-        ispc_tile.width = actual_tile_dims.x;
-        ispc_tile.height = actual_tile_dims.y;
-        ispc_tile.fb_width = fb_dims.x;
-        ispc_tile.fb_height = fb_dims.y;
-        ispc_tile.data = tiles[tile_id].data();
+        embree::Tile ispc_tile = make_ispc_tile(tile_id, ntiles);
         ispc_tile.ray_stats = ray_stats[tile_id].data();
+        ispc_tile.reservoirs = ris_candidates > 0 ? reservoirs[tile_id].data() : nullptr;
+        ispc_tile.prev_reservoirs =
+            reuse_reservoirs ? prev_reservoirs[tile_id].data() : nullptr;
+        if (radiance_cache) {
+            // Clear the previous frame's updates, not all training paths use all theirs
+            std::fill(cache_updates[tile_id].begin(),
+                      cache_updates[tile_id].end(),
+                      embree::RadianceCacheUpdate());
+            ispc_tile.cache_updates = cache_updates[tile_id].data();
+        }
+        if (path_guide) {
+            std::fill(guide_records[tile_id].begin(),
+                      guide_records[tile_id].end(),
+                      embree::GuideRecord());
+            ispc_tile.guide_records = guide_records[tile_id].data();
+        }
 
         ispc::trace_rays(&ispc_scene, &ispc_tile, &view_params);
 
-        ispc::tile_to_uint8(&ispc_tile, color);
+        // The denoiser writes the framebuffer once all tiles are done
+        if (!denoise) {
+            ispc::tile_to_uint8(&ispc_tile, color);
+        }
 #ifdef REPORT_RAY_STATS
         num_rays[tile_id] = std::accumulate(
             ray_stats[tile_id].begin(),
@@ -202,9 +687,27 @@ RenderStats RenderEmbree::render(const glm::vec3 &pos,
             [](const uint64_t &total, const uint16_t &c) { return total + c; });
 #endif
     });
+    if (radiance_cache) {
+        radiance_cache->update(cache_updates);
+    }
+    if (path_guide) {
+        path_guide->update(guide_records);
+    }
+    if (denoise) {
+        denoise_image(ntiles, color);
+    }
     auto end = high_resolution_clock::now();
     stats.render_time = duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
 
+    std::swap(reservoirs, prev_reservoirs);
+
+    // Evict streamed meshes now that the frame's rays are done
+    if (geometry_streamer) {
+        geometry_streamer->end_frame();
+        stats.streamed_loads = geometry_streamer->loads;
+        stats.streamed_evictions = geometry_streamer->evictions;
+    }
+
 #ifdef REPORT_RAY_STATS
     const uint64_t total_rays = std::accumulate(num_rays.begin(), num_rays.end(), 0);
     stats.rays_per_second = total_rays / (stats.render_time * 1.0e-3);
@@ -214,3 +717,162 @@ RenderStats RenderEmbree::render(const glm::vec3 &pos,
 
     return stats;
 }
+
+embree::Tile RenderEmbree::make_ispc_tile(const uint32_t tile_id, const glm::uvec2 &ntiles)
+{
+    const glm::uvec2 tile = glm::uvec2(tile_id % ntiles.x, tile_id / ntiles.x);
+    const glm::uvec2 tile_pos = tile * tile_size;
+    const glm::uvec2 tile_end = glm::min(tile_pos + tile_size, fb_dims);
+    const glm::uvec2 actual_tile_dims = tile_end - tile_pos;
+
+    embree::Tile ispc_tile;
+    ispc_tile.x = tile_pos.x;
+    ispc_tile.y = tile_pos.y;
+    ispc_tile.width = actual_tile_dims.x;
+    ispc_tile.height = actual_tile_dims.y;
+    ispc_tile.fb_width = fb_dims.x;
+    ispc_tile.fb_height = fb_dims.y;
+    ispc_tile.data = tiles[tile_id].data();
+    ispc_tile.ray_stats = nullptr;
+    ispc_tile.reservoirs = nullptr;
+    ispc_tile.prev_reservoirs = nullptr;
+    ispc_tile.aovs = denoise || render_aovs ? aovs[tile_id].data() : nullptr;
+    ispc_tile.cache_updates = nullptr;
+    ispc_tile.guide_records = nullptr;
+    return ispc_tile;
+}
+
+void RenderEmbree::denoise_image(const glm::uvec2 &ntiles, uint8_t *color)
+{
+    // Number of a-trous iterations, the last one filters with a step of 16 pixels giving
+    // a 65x65 pixel footprint
+    const int num_iterations = 5;
+    /* Allowed relative luminance difference between pixels at one sample per pixel. The
+     * noise falls off with the square root of the number of samples, so the filter
+     * blurs less as the image converges. Each iteration halves the allowed difference
+     * as the earlier iterations have already removed the high frequency noise
+     */
+    const float color_sigma = 4.f / std::sqrt(float((frame_id + 1) * samples_per_pixel));
+
+    const size_t num_pixels = size_t(fb_dims.x) * fb_dims.y;
+    denoise_features.resize(num_pixels * AOV_STRIDE);
+    denoise_irradiance[0].resize(num_pixels * 3);
+    denoise_irradiance[1].resize(num_pixels * 3);
+
+    const uint32_t num_tiles = ntiles.x * ntiles.y;
+    tbb::parallel_for(uint32_t(0), num_tiles, [&](uint32_t tile_id) {
+        embree::Tile ispc_tile = make_ispc_tile(tile_id, ntiles);
+        ispc::tile_to_denoiser_input(
+            &ispc_tile, denoise_irradiance[0].data(), denoise_features.data());
+    });
+    for (int i = 0; i < num_iterations; ++i) {
+        const float *input = denoise_irradiance[i % 2].data();
+        float *output = denoise_irradiance[(i + 1) % 2].data();
+        const float iteration_sigma = color_sigma / (1 << i);
+        tbb::parallel_for(uint32_t(0), num_tiles, [&](uint32_t tile_id) {
+            embree::Tile ispc_tile = make_ispc_tile(tile_id, ntiles);
+            ispc::atrous_filter(
+                &ispc_tile, denoise_features.data(), input, output, 1 << i, iteration_sigma);
+        });
+    }
+    const float *result = denoise_irradiance[num_iterations % 2].data();
+    tbb::parallel_for(uint32_t(0), num_tiles, [&](uint32_t tile_id) {
+        embree::Tile ispc_tile = make_ispc_tile(tile_id, ntiles);
+        ispc::denoised_to_uint8(&ispc_tile, denoise_features.data(), result, color);
+    });
+}
+
+void RenderEmbree::select_lods(const glm::vec3 &pos, const float pixel_angle)
+{
+    /* Building a level replaces its estimated edge length with the actual one, which can
+     * change the selection, so we select again until every selected level is built
+     */
+    std::vector<std::pair<size_t, uint32_t>> unbuilt;
+    do {
+        tbb::parallel_for(size_t(0), instance_lods.size(), [&](size_t i) {
+            InstanceLOD &lod = instance_lods[i];
+            const MeshLODs &lods = mesh_lods[lod.mesh_id];
+            // Approximate the instance's distance by the distance to its bounding sphere,
+            // so the camera being inside the instance selects the full mesh
+            const float distance = std::max(glm::length(lod.center - pos) - lod.radius, 0.f);
+            lod.selected = 0;
+            for (uint32_t l = 1; l < lods.levels.size(); ++l) {
+                const float projected_edge =
+                    lods.edge_lengths[l] * lod.scale / (distance * pixel_angle);
+                if (projected_edge > lod_threshold) {
+                    break;
+                }
+                lod.selected = l;
+            }
+        });
+
+        unbuilt.clear();
+        for (const auto &lod : instance_lods) {
+            if (!mesh_lods[lod.mesh_id].levels[lod.selected]) {
+                unbuilt.emplace_back(lod.mesh_id, lod.selected);
+            }
+        }
+        std::sort(unbuilt.begin(), unbuilt.end());
+        unbuilt.erase(std::unique(unbuilt.begin(), unbuilt.end()), unbuilt.end());
+        // Levels of the same mesh are built in order since each one reuses the finest
+        // built level below it if it doesn't simplify the mesh further
+        std::vector<size_t> mesh_starts;
+        for (size_t i = 0; i < unbuilt.size(); ++i) {
+            if (i == 0 || unbuilt[i].first != unbuilt[i - 1].first) {
+                mesh_starts.push_back(i);
+            }
+        }
+        mesh_starts.push_back(unbuilt.size());
+        tbb::parallel_for(size_t(0), mesh_starts.size() - 1, [&](size_t m) {
+            for (size_t i = mesh_starts[m]; i < mesh_starts[m + 1]; ++i) {
+                build_lod(unbuilt[i].first, unbuilt[i].second);
+            }
+        });
+    } while (!unbuilt.empty());
+
+    std::atomic<bool> changed(false);
+    tbb::parallel_for(size_t(0), instance_lods.size(), [&](size_t i) {
+        InstanceLOD &lod = instance_lods[i];
+        if (lod.selected == lod.level) {
+            return;
+        }
+
+        const MeshLODs &lods = mesh_lods[lod.mesh_id];
+        lod.level = lod.selected;
+        scene_bvh->instances[lod.instance_id]->set_mesh(lods.levels[lod.level]);
+        scene_bvh->ispc_instances[lod.instance_id].geometries =
+            lods.levels[lod.level]->ispc_geometries.data();
+        changed = true;
+    });
+    if (changed) {
+        rtcCommitScene(scene_bvh->handle);
+    }
+}
+
+void RenderEmbree::build_lod(const size_t mesh_id, const uint32_t level)
+{
+    MeshLODs &lods = mesh_lods[mesh_id];
+    uint32_t finer = level - 1;
+    while (!lods.levels[finer]) {
+        --finer;
+    }
+
+    ::Mesh simplified;
+    simplified.geometries = scene->meshes[mesh_id].generate_lod(lods.edge_lengths[level]);
+    const size_t num_tris = simplified.num_tris();
+    if (num_tris > 0.9 * lods.num_tris[finer]) {
+        lods.levels[level] = lods.levels[finer];
+        lods.edge_lengths[level] = lods.edge_lengths[finer];
+        lods.num_tris[level] = lods.num_tris[finer];
+        return;
+    }
+
+    const embree::BVHBuildParams build_params(scene->render_params);
+    lods.levels[level] =
+        build_mesh(device, simplified.geometries, build_params, scene->render_params);
+    lods.edge_lengths[level] = simplified.average_edge_length();
+    lods.num_tris[level] = num_tris;
+    for (const auto &g : lods.levels[level]->geometries) {
+        geometry_bytes += g->nbytes();
+    }
+}
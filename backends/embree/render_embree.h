@@ -1,30 +1,119 @@
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <utility>
 #include <vector>
 #include <embree4/rtcore.h>
 #include "embree_utils.h"
+#include "geometry_streamer.h"
+#include "texture_cache.h"
 #include "material.h"
 #include "render_backend.h"
+#include "sampler_type.h"
 
 struct RenderEmbree : RenderBackend {
     RTCDevice device;
     glm::uvec2 fb_dims;
 
-    // TODO: should take scene as shared ptr and keep ref to it,
-    std::vector<ParameterizedMesh> parameterized_meshes;
+    // Bytes currently allocated by Embree, tracked through the device memory monitor
+    std::atomic<int64_t> embree_bytes;
+    // Time in ms to build the BVHs and the memory they use, for the last set_scene
+    double bvh_build_time = 0.0;
+    int64_t bvh_bytes = 0;
+    /* Bytes of the geometry buffers copied out of the scene, see embree::Geometry. Levels
+     * of detail are built concurrently while rendering and add to it
+     */
+    std::atomic<size_t> geometry_bytes;
+
+    /* The geometry buffers are shared with the scene, so we keep a reference to it
+     * unless we're using compact attributes and no levels of detail, which are built from
+     * the scene's meshes when first selected. The materials, textures and lights are
+     * copied, and released from scenes handed over through take_scene
+     */
+    std::shared_ptr<const Scene> scene;
     std::shared_ptr<embree::TopLevelBVH> scene_bvh;
+    // Only created for out-of-core scenes
+    std::unique_ptr<embree::GeometryStreamer> geometry_streamer;
+
+    /* The bottom level BVHs of each mesh's levels of detail, level 0 is the full mesh.
+     * The coarser levels are null until an instance first selects them
+     */
+    struct MeshLODs {
+        std::vector<std::shared_ptr<embree::TriangleMesh>> levels;
+        /* Average triangle edge length of each level in object space, levels which
+         * haven't been built yet are estimated by their clustering cell size
+         */
+        std::vector<float> edge_lengths;
+        // Triangle count of each built level
+        std::vector<size_t> num_tris;
+        glm::vec3 bounds_min, bounds_max;
+    };
+    std::vector<MeshLODs> mesh_lods;
+
+    // The level of detail of each instance in the top level BVH which has LODs
+    struct InstanceLOD {
+        size_t instance_id = 0;
+        size_t mesh_id = 0;
+        // World space bounding sphere of the instance
+        glm::vec3 center;
+        float radius = 0.f;
+        // Largest scaling of the instance's transform
+        float scale = 1.f;
+        uint32_t level = 0;
+        // The level picked by the current selection, which may not be built yet
+        uint32_t selected = 0;
+    };
+    std::vector<InstanceLOD> instance_lods;
+    // Max projected triangle edge length in pixels of the selected levels
+    float lod_threshold = 1.f;
 
     std::vector<embree::MaterialParams> material_params;
     std::vector<QuadLight> lights;
-    std::vector<Image> textures;
+    std::vector<embree::AliasEntry> light_alias_table;
+    std::vector<embree::LightBVHNode> light_bvh;
+    // Only created if the scene has an environment map
+    std::unique_ptr<embree::EnvironmentMap> environment;
+    embree::ISPCEnvironmentMap ispc_environment;
+    std::vector<std::shared_ptr<embree::Texture2D>> textures;
     std::vector<embree::ISPCTexture2D> ispc_textures;
+    // Only created if a texture cache budget is set
+    std::unique_ptr<embree::TextureCache> texture_cache;
 
     uint32_t frame_id = 0;
     glm::uvec2 tile_size = glm::uvec2(64);
     std::vector<std::vector<float>> tiles;
     std::vector<std::vector<uint16_t>> ray_stats;
+    // Resampled direct lighting options, and each tile's reservoirs for the current
+    // and previous frame
+    uint32_t ris_candidates = 0;
+    bool ris_temporal_reuse = false;
+    bool ris_spatial_reuse = false;
+    std::vector<std::vector<embree::Reservoir>> reservoirs;
+    std::vector<std::vector<embree::Reservoir>> prev_reservoirs;
+    // One of the SAMPLER_* types
+    uint32_t sampler = SAMPLER_LCG;
+    // Path length and Russian roulette options, see RenderParams
+    uint32_t max_path_depth = 5;
+    uint32_t max_diffuse_depth = 0;
+    uint32_t max_specular_depth = 0;
+    uint32_t roulette_start = 3;
+    bool efficiency_roulette = false;
+    // Each tile's accumulated AOVs, written if denoising or rendering AOVs
+    bool render_aovs = false;
+    std::vector<std::vector<float>> aovs;
+    // The framebuffer sized denoiser buffers, the filter iterations ping-pong between
+    // the two irradiance buffers
+    bool denoise = false;
+    std::vector<float> denoise_features;
+    std::vector<float> denoise_irradiance[2];
+    // Only created if the radiance cache is enabled, along with each tile's updates
+    std::unique_ptr<embree::RadianceCache> radiance_cache;
+    uint32_t radiance_cache_bounce = 1;
+    std::vector<std::vector<embree::RadianceCacheUpdate>> cache_updates;
+    // Only created if path guiding is enabled, along with each tile's training records
+    std::unique_ptr<embree::PathGuide> path_guide;
+    std::vector<std::vector<embree::GuideRecord>> guide_records;
 #ifdef REPORT_RAY_STATS
     std::vector<uint64_t> num_rays;
 #endif
@@ -34,11 +123,38 @@ struct RenderEmbree : RenderBackend {
 
     std::string name() override;
     void initialize(const int fb_width, const int fb_height) override;
-    void set_scene(const Scene &scene) override;
+    void set_scene(const std::shared_ptr<const Scene> &scene) override;
+    void take_scene(std::shared_ptr<Scene> scene) override;
+    void update_scene(const Scene &scene) override;
+    bool supports_instance_groups() override;
+    bool supports_out_of_core() override;
+    bool supports_lod() override;
+    bool supports_aovs() override;
+    bool supports_texture_cache() override;
+    std::vector<ImageLayer> read_aovs() override;
+    void memory_report(MemoryReport &report) override;
     RenderStats render(const glm::vec3 &pos,
                        const glm::vec3 &dir,
                        const glm::vec3 &up,
                        const float fovy,
                        const bool camera_changed,
                        const bool readback_framebuffer) override;
+
+private:
+    /* Select the level of detail of each instance for the camera position and angle
+     * subtended by a pixel, building any levels selected for the first time and
+     * recommitting the top level BVH if any instance changed level
+     */
+    void select_lods(const glm::vec3 &pos, const float pixel_angle);
+
+    /* Build the level of detail of the mesh from the scene's mesh. Levels which don't
+     * drop the triangle count of the finest built level below them reuse that level
+     */
+    void build_lod(const size_t mesh_id, const uint32_t level);
+
+    // Make the ISPC tile for the tile's region of the framebuffer and accumulated color
+    embree::Tile make_ispc_tile(const uint32_t tile_id, const glm::uvec2 &ntiles);
+
+    // Denoise the accumulated image of the current frame and write it to the framebuffer
+    void denoise_image(const glm::uvec2 &ntiles, uint8_t *color);
 };
@@ -0,0 +1,13 @@
+// This header is shared between the C++ and ISPC code of the Embree backend
+
+#ifndef EMBREE_SAMPLER_TYPE_H
+#define EMBREE_SAMPLER_TYPE_H
+
+// Independent random numbers from a per-pixel LCG
+#define SAMPLER_LCG 0
+// Owen scrambled Sobol points, padded to higher dimensions by shuffling
+#define SAMPLER_SOBOL 1
+// Golden ratio sequence over the samples, dithered across pixels by a blue noise mask
+#define SAMPLER_BLUE_NOISE 2
+
+#endif
@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include "render_embree.h"
+#include "render_embree_ispc.h"
+#include "scene.h"
+#include "util.h"
+
+// Add the cache lines holding the object to the lines, if they're not already in them
+template <typename T>
+static void touch_lines(const T *addr, std::vector<uintptr_t> &lines)
+{
+    const uintptr_t first = reinterpret_cast<uintptr_t>(addr) / 64;
+    const uintptr_t last = (reinterpret_cast<uintptr_t>(addr) + sizeof(T) - 1) / 64;
+    for (uintptr_t line = first; line <= last; ++line) {
+        if (std::find(lines.begin(), lines.end(), line) == lines.end()) {
+            lines.push_back(line);
+        }
+    }
+}
+
+/* Count the distinct cache lines hit_attributes reads to shade a hit on the triangle,
+ * matching the loads it makes with and without the shading records
+ */
+static size_t hit_cache_lines(const embree::ISPCGeometry &geom, const uint32_t prim)
+{
+    std::vector<uintptr_t> lines;
+    if (!geom.uv_buf && !geom.packed_uv_buf) {
+        return 0;
+    }
+    if (geom.shading_records) {
+        touch_lines(&geom.shading_records[prim], lines);
+        return lines.size();
+    }
+    touch_lines(&geom.index_buf[prim], lines);
+    const glm::uvec3 indices = geom.index_buf[prim];
+    for (int i = 0; i < 3; ++i) {
+        if (geom.uv_buf) {
+            touch_lines(&geom.uv_buf[indices[i]], lines);
+        } else {
+            touch_lines(&geom.packed_uv_buf[indices[i]], lines);
+        }
+        touch_lines(&geom.vertex_buf[indices[i]], lines);
+    }
+    return lines.size();
+}
+
+/* Microbenchmark comparing the time to compute the hit attributes (uv and texture LOD)
+ * of hits on random triangles in the scene, with and without the
+ * per-triangle shading records. Random hits over a high-poly scene approximate the
+ * incoherent hits of secondary bounces. Along with the timings it reports the number of
+ * distinct cache lines each hit reads.
+ * Usage: shading_record_bench <scene file> [-hits <n>] [-iters <n>]
+ */
+int main(int argc, const char **argv)
+{
+    const std::vector<std::string> args(argv, argv + argc);
+    std::string scene_file;
+    size_t num_hits = 1 << 24;
+    int iterations = 10;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "-hits") {
+            num_hits = std::stoull(args[++i]);
+        } else if (args[i] == "-iters") {
+            iterations = std::stoi(args[++i]);
+        } else if (args[i][0] != '-') {
+            scene_file = args[i];
+            canonicalize_path(scene_file);
+        }
+    }
+    if (scene_file.empty()) {
+        std::cout << "Usage: shading_record_bench <scene file> [-hits <n>] [-iters <n>]\n";
+        return 1;
+    }
+
+    auto scene = std::make_shared<Scene>(scene_file, MaterialMode::DEFAULT);
+    scene->flatten_instance_groups();
+
+    // Pick random triangles of random instances, the same hits are used for both runs
+    std::mt19937 rng(5);
+    std::uniform_real_distribution<float> bary_distrib(0.f, 1.f);
+    std::uniform_int_distribution<size_t> instance_distrib(0, scene->instances.size() - 1);
+    std::vector<uint32_t> hits(num_hits * 3);
+    std::vector<float> barys(num_hits * 2);
+    for (size_t i = 0; i < num_hits; ++i) {
+        const size_t inst = instance_distrib(rng);
+        const size_t pm_id = scene->instances[inst].parameterized_mesh_id;
+        const Mesh &mesh = scene->meshes[scene->parameterized_meshes[pm_id].mesh_id];
+        const size_t geom =
+            std::uniform_int_distribution<size_t>(0, mesh.geometries.size() - 1)(rng);
+        const size_t num_tris = mesh.geometries[geom].num_tris();
+        hits[i * 3] = inst;
+        hits[i * 3 + 1] = geom;
+        hits[i * 3 + 2] = std::uniform_int_distribution<size_t>(0, num_tris - 1)(rng);
+
+        float u = bary_distrib(rng);
+        float v = bary_distrib(rng);
+        if (u + v > 1.f) {
+            u = 1.f - u;
+            v = 1.f - v;
+        }
+        barys[i * 2] = u;
+        barys[i * 2 + 1] = v;
+    }
+    std::vector<float> results(num_hits, 0.f);
+
+    std::cout << "Shading " << num_hits << " random hits on '" << scene_file << "', "
+              << pretty_print_count(scene->unique_tris()) << " unique triangles, "
+              << iterations << " iterations\n";
+
+    const size_t block_size = 4096;
+    const std::vector<std::pair<bool, std::string>> modes = {{false, "buffers"},
+                                                             {true, "shading records"}};
+    for (const auto &mode : modes) {
+        scene->render_params.shading_records = mode.first;
+        RenderEmbree renderer;
+        renderer.set_scene(scene);
+        const embree::ISPCInstance *instances = renderer.scene_bvh->ispc_instances.data();
+
+        size_t total_lines = 0;
+        for (size_t i = 0; i < num_hits; ++i) {
+            const embree::ISPCInstance &inst = instances[hits[i * 3]];
+            total_lines += hit_cache_lines(inst.geometries[hits[i * 3 + 1]], hits[i * 3 + 2]);
+        }
+
+        double total_ms = 0.0;
+        for (int it = 0; it < iterations; ++it) {
+            using namespace std::chrono;
+            auto start = high_resolution_clock::now();
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, num_hits, block_size),
+                              [&](const tbb::blocked_range<size_t> &r) {
+                                  ispc::shade_hits(instances,
+                                                   hits.data() + r.begin() * 3,
+                                                   barys.data() + r.begin() * 2,
+                                                   r.size(),
+                                                   results.data() + r.begin());
+                              });
+            auto end = high_resolution_clock::now();
+            total_ms += duration_cast<nanoseconds>(end - start).count() * 1.0e-6;
+        }
+        const double avg_ms = total_ms / iterations;
+        std::cout << mode.second << ": " << avg_ms << "ms, "
+                  << avg_ms * 1.0e6 / num_hits << "ns/hit, "
+                  << pretty_print_count(num_hits / (avg_ms * 1.0e-3)) << "hits/s, "
+                  << double(total_lines) / num_hits << " cache lines/hit\n";
+    }
+    return 0;
+}
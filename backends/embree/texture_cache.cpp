@@ -0,0 +1,277 @@
+#include "texture_cache.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include "embree_utils.h"
+#include "json.hpp"
+
+namespace embree {
+
+using json = nlohmann::json;
+
+static const size_t TILE_TEXELS = TEXTURE_CACHE_TILE_DIM * TEXTURE_CACHE_TILE_DIM;
+static const size_t TILE_BYTES = TILE_TEXELS * 4;
+static const size_t NUM_SHARDS = 64;
+// Texels fetched per pass of fetch_texels, enough for the 4 taps of a 16 wide lookup
+static const uint32_t MAX_BATCH = 64;
+
+TextureCache::TextureCache(const std::string &backing_file, const size_t budget_bytes)
+    : backing_file(backing_file),
+      shard_budget(std::max(budget_bytes / NUM_SHARDS, TILE_BYTES)),
+      hits(0),
+      misses(0),
+      reused_textures(0)
+{
+    read_index();
+    // New tiles are appended to a valid backing file, otherwise it's rebuilt from scratch
+    const auto mode = index.empty() ? std::ios::trunc : std::ios::app;
+    writer.open(backing_file, std::ios::binary | mode);
+    if (!writer) {
+        throw std::runtime_error("Failed to open texture cache file " + backing_file);
+    }
+    for (size_t i = 0; i < NUM_SHARDS; ++i) {
+        shards.push_back(std::make_unique<Shard>());
+    }
+}
+
+TextureCache::~TextureCache()
+{
+    shards.clear();
+    if (writer.is_open()) {
+        finalize();
+    }
+}
+
+std::string TextureCache::index_file() const
+{
+    return backing_file + ".index";
+}
+
+void TextureCache::read_index()
+{
+    std::ifstream in(index_file());
+    if (!in) {
+        return;
+    }
+    try {
+        const json j = json::parse(in);
+        if (j["tile_dim"].get<uint32_t>() != TEXTURE_CACHE_TILE_DIM) {
+            return;
+        }
+        // The tiles must all have been written out for the index to be valid
+        const uint64_t file_tiles = j["num_tiles"].get<uint64_t>();
+        std::ifstream file(backing_file, std::ios::binary | std::ios::ate);
+        if (!file || uint64_t(file.tellg()) != file_tiles * TILE_BYTES) {
+            return;
+        }
+        for (const auto &t : j["textures"].items()) {
+            CachedTexture cached;
+            cached.channels = t.value()["channels"].get<int>();
+            for (const auto &l : t.value()["levels"]) {
+                CachedLevel level;
+                level.width = l[0].get<int>();
+                level.height = l[1].get<int>();
+                level.first_tile = l[2].get<uint64_t>();
+                cached.levels.push_back(level);
+            }
+            index[t.key()] = cached;
+        }
+        num_tiles = file_tiles;
+    } catch (const json::exception &e) {
+        std::cerr << "Ignoring invalid texture cache index " << index_file() << ": "
+                  << e.what() << "\n";
+        index.clear();
+    }
+}
+
+uint64_t TextureCache::write_level(const Image &level)
+{
+    const size_t tiles_x = (level.width + TEXTURE_CACHE_TILE_DIM - 1) / TEXTURE_CACHE_TILE_DIM;
+    const size_t tiles_y =
+        (level.height + TEXTURE_CACHE_TILE_DIM - 1) / TEXTURE_CACHE_TILE_DIM;
+
+    std::vector<uint8_t> tile(TILE_BYTES);
+    std::lock_guard<std::mutex> lock(write_mutex);
+    const uint64_t first_tile = num_tiles;
+    num_tiles += tiles_x * tiles_y;
+    for (size_t ty = 0; ty < tiles_y; ++ty) {
+        for (size_t tx = 0; tx < tiles_x; ++tx) {
+            std::fill(tile.begin(), tile.end(), 0);
+            for (size_t j = 0; j < TEXTURE_CACHE_TILE_DIM; ++j) {
+                const size_t y = ty * TEXTURE_CACHE_TILE_DIM + j;
+                for (size_t i = 0; i < TEXTURE_CACHE_TILE_DIM; ++i) {
+                    const size_t x = tx * TEXTURE_CACHE_TILE_DIM + i;
+                    if (x < size_t(level.width) && y < size_t(level.height)) {
+                        std::memcpy(&tile[(j * TEXTURE_CACHE_TILE_DIM + i) * 4],
+                                    &level.img[(y * level.width + x) * level.channels],
+                                    level.channels);
+                    }
+                }
+            }
+            writer.write(reinterpret_cast<const char *>(tile.data()), tile.size());
+        }
+    }
+    if (!writer) {
+        throw std::runtime_error("Failed to write texture cache file " + backing_file);
+    }
+    return first_tile;
+}
+
+std::shared_ptr<Texture2D> TextureCache::make_texture(const CachedTexture &cached)
+{
+    std::vector<Image> levels;
+    std::vector<uint64_t> first_tiles;
+    for (const auto &l : cached.levels) {
+        Image level;
+        level.width = l.width;
+        level.height = l.height;
+        level.channels = cached.channels;
+        levels.push_back(level);
+        first_tiles.push_back(l.first_tile);
+    }
+    return std::make_shared<Texture2D>(this, std::move(levels), first_tiles);
+}
+
+std::shared_ptr<Texture2D> TextureCache::add_texture(const Image &img)
+{
+    const std::string key = img.key();
+    {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        auto fnd = index.find(key);
+        if (fnd != index.end()) {
+            ++reused_textures;
+            return make_texture(fnd->second);
+        }
+    }
+
+    Image level = img.is_encoded() ? img.decode() : img;
+    linearize_srgb(level);
+
+    CachedTexture cached;
+    cached.channels = level.channels;
+    while (true) {
+        cached.levels.push_back(CachedLevel{level.width, level.height, write_level(level)});
+        if (level.width == 1 && level.height == 1) {
+            break;
+        }
+        level = next_mip_level(level);
+    }
+
+    std::lock_guard<std::mutex> lock(write_mutex);
+    index[key] = cached;
+    index_changed = true;
+    return make_texture(cached);
+}
+
+void TextureCache::finalize()
+{
+    std::lock_guard<std::mutex> lock(write_mutex);
+    writer.close();
+    if (!index_changed) {
+        return;
+    }
+
+    json j;
+    j["tile_dim"] = TEXTURE_CACHE_TILE_DIM;
+    j["num_tiles"] = num_tiles;
+    j["textures"] = json::object();
+    for (const auto &t : index) {
+        json levels = json::array();
+        for (const auto &l : t.second.levels) {
+            levels.push_back({l.width, l.height, l.first_tile});
+        }
+        j["textures"][t.first] = {{"channels", t.second.channels}, {"levels", levels}};
+    }
+    std::ofstream out(index_file());
+    out << j;
+    if (!out) {
+        std::cerr << "Failed to write texture cache index " << index_file() << "\n";
+    }
+    index_changed = false;
+}
+
+void TextureCache::fetch_texels(const uint32_t n,
+                                const uint64_t *tiles,
+                                const uint32_t *texels,
+                                uint32_t *rgba)
+{
+    for (uint32_t start = 0; start < n; start += MAX_BATCH) {
+        const uint32_t end = std::min(start + MAX_BATCH, n);
+        bool fetched[MAX_BATCH] = {false};
+        for (uint32_t i = start; i < end; ++i) {
+            if (fetched[i - start]) {
+                continue;
+            }
+            // Lock the tile once and copy out all the batch's texels in it
+            Shard &shard = *shards[tiles[i] % NUM_SHARDS];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            const uint8_t *tile = find_tile(shard, tiles[i]);
+            for (uint32_t j = i; j < end; ++j) {
+                if (tiles[j] == tiles[i]) {
+                    std::memcpy(&rgba[j], &tile[texels[j] * 4], sizeof(uint32_t));
+                    fetched[j - start] = true;
+                }
+            }
+        }
+    }
+}
+
+const uint8_t *TextureCache::find_tile(Shard &shard, const uint64_t tile)
+{
+    auto fnd = shard.tiles.find(tile);
+    if (fnd != shard.tiles.end()) {
+        ++hits;
+        shard.lru.splice(shard.lru.begin(), shard.lru, fnd->second);
+    } else {
+        ++misses;
+        if (!shard.file.is_open()) {
+            shard.file.open(backing_file, std::ios::binary);
+        }
+
+        // Evict least recently used tiles to make room, reusing the last one's memory
+        std::vector<uint8_t> texels;
+        while (!shard.lru.empty() && (shard.lru.size() + 1) * TILE_BYTES > shard_budget) {
+            texels = std::move(shard.lru.back().texels);
+            shard.tiles.erase(shard.lru.back().id);
+            shard.lru.pop_back();
+        }
+        texels.resize(TILE_BYTES);
+
+        shard.file.seekg(tile * TILE_BYTES);
+        shard.file.read(reinterpret_cast<char *>(texels.data()), TILE_BYTES);
+        // This is called from the ISPC kernels so we can't throw, just return black texels
+        if (!shard.file) {
+            std::cerr << "Failed to read tile " << tile << " from texture cache file "
+                      << backing_file << "\n";
+            shard.file.clear();
+            std::fill(texels.begin(), texels.end(), 0);
+        }
+
+        shard.lru.push_front(Tile{tile, std::move(texels)});
+        shard.tiles[tile] = shard.lru.begin();
+    }
+
+    return shard.lru.front().texels.data();
+}
+
+size_t TextureCache::resident_bytes()
+{
+    size_t bytes = 0;
+    for (auto &s : shards) {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        bytes += s->lru.size() * TILE_BYTES;
+    }
+    return bytes;
+}
+
+}
+
+extern "C" void texture_cache_fetch_texels(void *cache,
+                                           const uint32_t n,
+                                           const uint64_t *tiles,
+                                           const uint32_t *texels,
+                                           uint32_t *rgba)
+{
+    reinterpret_cast<embree::TextureCache *>(cache)->fetch_texels(n, tiles, texels, rgba);
+}
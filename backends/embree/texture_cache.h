@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "material.h"
+#include "texture_layout.h"
+
+namespace embree {
+
+struct Texture2D;
+
+/* A bounded memory cache of texture tiles, backed by a persistent tile file. The mip
+ * levels of cached textures are written to the file in TEXTURE_CACHE_TILE_DIM x
+ * TEXTURE_CACHE_TILE_DIM RGBA8 tiles, and an index file next to it maps each texture's
+ * source to its tiles so later runs reuse them without decoding the texture again.
+ * Tiles are read in on first access while rendering and evicted in least recently used
+ * order to stay within the memory budget.
+ */
+class TextureCache {
+    struct Tile {
+        uint64_t id;
+        std::vector<uint8_t> texels;
+    };
+
+    // The cache is split into shards with their own lock, LRU list and file handle
+    // to reduce contention between the render threads
+    struct Shard {
+        std::mutex mutex;
+        std::list<Tile> lru;
+        std::unordered_map<uint64_t, std::list<Tile>::iterator> tiles;
+        std::ifstream file;
+    };
+
+    struct CachedLevel {
+        int width = -1;
+        int height = -1;
+        uint64_t first_tile = 0;
+    };
+
+    struct CachedTexture {
+        int channels = -1;
+        std::vector<CachedLevel> levels;
+    };
+
+    std::string backing_file;
+    size_t shard_budget = 0;
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    /* Find the tile in the shard, loading it if it's not resident. The shard's lock must
+     * be held, the texels are only valid until it's released
+     */
+    const uint8_t *find_tile(Shard &shard, const uint64_t tile);
+
+    // The write mutex guards the writer, the tile count and the index
+    std::mutex write_mutex;
+    std::ofstream writer;
+    uint64_t num_tiles = 0;
+    std::unordered_map<std::string, CachedTexture> index;
+    bool index_changed = false;
+
+    std::string index_file() const;
+
+    /* Read the index of the backing file, leaving the index empty if it's missing or
+     * doesn't match the backing file
+     */
+    void read_index();
+
+    // Write the level's tiles to the end of the backing file, returning the first tile
+    uint64_t write_level(const Image &level);
+
+    std::shared_ptr<Texture2D> make_texture(const CachedTexture &cached);
+
+public:
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+
+    // Textures whose tiles were found in the backing file instead of being built
+    std::atomic<uint32_t> reused_textures;
+
+    TextureCache(const std::string &backing_file, const size_t budget_bytes);
+    ~TextureCache();
+
+    TextureCache(const TextureCache &) = delete;
+    TextureCache &operator=(const TextureCache &) = delete;
+
+    /* Add the image to the cache, returning the texture in the TEXTURE_LAYOUT_CACHED
+     * layout. If the image's tiles aren't in the backing file yet the image is decoded,
+     * then each mip level is built from the previous one, written out and released, so at
+     * most the decoded image and its next level are in memory. Safe to call from multiple
+     * threads
+     */
+    std::shared_ptr<Texture2D> add_texture(const Image &img);
+
+    /* Finish writing the backing file and its index, must be called before fetching any
+     * texels
+     */
+    void finalize();
+
+    /* Fetch the n RGBA8 texels, each from its tile, loading the tiles which aren't
+     * resident. Each distinct tile is looked up once, so batching the texels of nearby
+     * lookups avoids locking the same tile repeatedly
+     */
+    void fetch_texels(const uint32_t n,
+                      const uint64_t *tiles,
+                      const uint32_t *texels,
+                      uint32_t *rgba);
+
+    size_t resident_bytes();
+};
+
+}
+
+// Called from the ISPC kernels to fetch texels of cached textures
+extern "C" void texture_cache_fetch_texels(void *cache,
+                                           const uint32_t n,
+                                           const uint64_t *tiles,
+                                           const uint32_t *texels,
+                                           uint32_t *rgba);
@@ -0,0 +1,195 @@
+#include "texture_compression.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include "texture_layout.h"
+#include <glm/glm.hpp>
+
+namespace embree {
+
+uint32_t select_compressed_layout(const Image &img)
+{
+    if (img.channels == 1) {
+        return TEXTURE_LAYOUT_BC4;
+    }
+    if (img.channels == 2) {
+        return TEXTURE_LAYOUT_BC5;
+    }
+    if (img.channels == 4) {
+        for (size_t i = 3; i < img.img.size(); i += 4) {
+            if (img.img[i] != 255) {
+                return TEXTURE_LAYOUT_BC3;
+            }
+        }
+    }
+    return TEXTURE_LAYOUT_BC1;
+}
+
+static size_t compressed_block_bytes(const uint32_t layout)
+{
+    return layout == TEXTURE_LAYOUT_BC1 || layout == TEXTURE_LAYOUT_BC4 ? 8 : 16;
+}
+
+std::vector<uint8_t> compress_image(const Image &img, const uint32_t layout)
+{
+    const size_t blocks_x = (img.width + TEXTURE_BLOCK_DIM - 1) / TEXTURE_BLOCK_DIM;
+    const size_t blocks_y = (img.height + TEXTURE_BLOCK_DIM - 1) / TEXTURE_BLOCK_DIM;
+    const size_t block_bytes = compressed_block_bytes(layout);
+    std::vector<uint8_t> compressed(blocks_x * blocks_y * block_bytes, 0);
+
+    std::array<uint8_t, TEXTURE_BLOCK_DIM * TEXTURE_BLOCK_DIM * 4> block;
+    for (size_t by = 0; by < blocks_y; ++by) {
+        for (size_t bx = 0; bx < blocks_x; ++bx) {
+            // Gather the block's texels, clamping to the edge of the image
+            for (size_t j = 0; j < TEXTURE_BLOCK_DIM; ++j) {
+                const size_t y = std::min(by * TEXTURE_BLOCK_DIM + j, size_t(img.height - 1));
+                for (size_t i = 0; i < TEXTURE_BLOCK_DIM; ++i) {
+                    const size_t x =
+                        std::min(bx * TEXTURE_BLOCK_DIM + i, size_t(img.width - 1));
+                    std::memcpy(&block[(j * TEXTURE_BLOCK_DIM + i) * img.channels],
+                                &img.img[(y * img.width + x) * img.channels],
+                                img.channels);
+                }
+            }
+
+            uint8_t *out = &compressed[(by * blocks_x + bx) * block_bytes];
+            switch (layout) {
+            case TEXTURE_LAYOUT_BC1:
+                encode_bc1_block(block.data(), img.channels, out);
+                break;
+            case TEXTURE_LAYOUT_BC3:
+                encode_bc4_block(block.data() + 3, img.channels, out);
+                encode_bc1_block(block.data(), img.channels, out + 8);
+                break;
+            case TEXTURE_LAYOUT_BC4:
+                encode_bc4_block(block.data(), img.channels, out);
+                break;
+            case TEXTURE_LAYOUT_BC5:
+                encode_bc4_block(block.data(), img.channels, out);
+                encode_bc4_block(block.data() + 1, img.channels, out + 8);
+                break;
+            default:
+                throw std::runtime_error("Invalid compressed texture layout");
+            }
+        }
+    }
+    return compressed;
+}
+
+static uint16_t pack_565(const glm::vec3 &c)
+{
+    const glm::uvec3 q = glm::uvec3(glm::round(glm::clamp(c, glm::vec3(0.f), glm::vec3(1.f)) *
+                                               glm::vec3(31.f, 63.f, 31.f)));
+    return (q.x << 11) | (q.y << 5) | q.z;
+}
+
+static glm::vec3 unpack_565(const uint16_t c)
+{
+    return glm::vec3((c >> 11) & 0x1f, (c >> 5) & 0x3f, c & 0x1f) /
+           glm::vec3(31.f, 63.f, 31.f);
+}
+
+void encode_bc1_block(const uint8_t *texels, const int channels, uint8_t *out)
+{
+    const size_t n_texels = TEXTURE_BLOCK_DIM * TEXTURE_BLOCK_DIM;
+    std::array<glm::vec3, TEXTURE_BLOCK_DIM * TEXTURE_BLOCK_DIM> colors;
+    glm::vec3 mean(0.f);
+    for (size_t i = 0; i < n_texels; ++i) {
+        colors[i] = glm::vec3(texels[i * channels],
+                              texels[i * channels + 1],
+                              texels[i * channels + 2]) /
+                    255.f;
+        mean += colors[i];
+    }
+    mean /= float(n_texels);
+
+    // Find the principal axis of the colors with a few power iterations on the
+    // covariance matrix, the endpoints are the extents of the colors along this axis
+    glm::mat3 covariance(0.f);
+    for (const auto &c : colors) {
+        const glm::vec3 d = c - mean;
+        covariance += glm::outerProduct(d, d);
+    }
+    glm::vec3 axis(1.f);
+    for (int i = 0; i < 8; ++i) {
+        const glm::vec3 next = covariance * axis;
+        const float len = glm::length(next);
+        if (len < 1e-8f) {
+            break;
+        }
+        axis = next / len;
+    }
+    float min_t = 0.f;
+    float max_t = 0.f;
+    for (const auto &c : colors) {
+        const float t = glm::dot(c - mean, axis);
+        min_t = std::min(t, min_t);
+        max_t = std::max(t, max_t);
+    }
+
+    uint16_t c0 = pack_565(mean + axis * max_t);
+    uint16_t c1 = pack_565(mean + axis * min_t);
+    // Endpoints must be ordered c0 > c1 to select the four color mode
+    if (c0 < c1) {
+        std::swap(c0, c1);
+    }
+
+    uint32_t indices = 0;
+    if (c0 != c1) {
+        const glm::vec3 e0 = unpack_565(c0);
+        const glm::vec3 e1 = unpack_565(c1);
+        const std::array<glm::vec3, 4> palette = {
+            e0, e1, (2.f * e0 + e1) / 3.f, (e0 + 2.f * e1) / 3.f};
+        for (size_t i = 0; i < n_texels; ++i) {
+            uint32_t best = 0;
+            float best_dist = std::numeric_limits<float>::infinity();
+            for (uint32_t p = 0; p < palette.size(); ++p) {
+                const glm::vec3 d = colors[i] - palette[p];
+                const float dist = glm::dot(d, d);
+                if (dist < best_dist) {
+                    best_dist = dist;
+                    best = p;
+                }
+            }
+            indices |= best << (2 * i);
+        }
+    }
+
+    std::memcpy(out, &c0, sizeof(uint16_t));
+    std::memcpy(out + 2, &c1, sizeof(uint16_t));
+    std::memcpy(out + 4, &indices, sizeof(uint32_t));
+}
+
+void encode_bc4_block(const uint8_t *texels, const int channels, uint8_t *out)
+{
+    const size_t n_texels = TEXTURE_BLOCK_DIM * TEXTURE_BLOCK_DIM;
+    uint8_t a0 = 0;
+    uint8_t a1 = 255;
+    for (size_t i = 0; i < n_texels; ++i) {
+        a0 = std::max(a0, texels[i * channels]);
+        a1 = std::min(a1, texels[i * channels]);
+    }
+
+    // With a0 > a1 the block uses the eight value mode: a0, a1 and six interpolated values
+    uint64_t indices = 0;
+    if (a0 != a1) {
+        for (size_t i = 0; i < n_texels; ++i) {
+            const float t = float(a0 - texels[i * channels]) / float(a0 - a1);
+            const uint64_t step = uint64_t(std::round(t * 7.f));
+            // Map the step along a0 -> a1 to the BC4 index ordering
+            const uint64_t index = step == 0 ? 0 : step == 7 ? 1 : step + 1;
+            indices |= index << (3 * i);
+        }
+    }
+
+    out[0] = a0;
+    out[1] = a1;
+    for (size_t i = 0; i < 6; ++i) {
+        out[2 + i] = (indices >> (8 * i)) & 0xff;
+    }
+}
+
+}
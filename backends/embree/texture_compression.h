@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "material.h"
+
+namespace embree {
+
+/* Select the block compressed TEXTURE_LAYOUT_BC* format to store the image in:
+ * BC1 for RGB and opaque RGBA images, BC3 for RGBA images using alpha,
+ * BC4 for single channel images and BC5 for two channel images
+ */
+uint32_t select_compressed_layout(const Image &img);
+
+/* Encode the image into 4x4 texel blocks in the compressed layout, blocks are stored in
+ * scanline order. The image is padded out to a multiple of the block size by clamping
+ */
+std::vector<uint8_t> compress_image(const Image &img, const uint32_t layout);
+
+// Encode a block of 16 RGB texels with a stride of channels bytes to an 8 byte BC1 block
+void encode_bc1_block(const uint8_t *texels, const int channels, uint8_t *out);
+
+// Encode a block of 16 single channel texels with a stride of channels bytes to an
+// 8 byte BC4 block
+void encode_bc4_block(const uint8_t *texels, const int channels, uint8_t *out);
+
+}
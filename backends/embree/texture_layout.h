@@ -0,0 +1,32 @@
+// This header is shared between the C++ and ISPC code of the Embree backend
+
+#ifndef EMBREE_TEXTURE_LAYOUT_H
+#define EMBREE_TEXTURE_LAYOUT_H
+
+#define TEXTURE_LAYOUT_LINEAR 0
+#define TEXTURE_LAYOUT_TILED 1
+// Block compressed layouts, following the BCn block formats
+#define TEXTURE_LAYOUT_BC1 2
+#define TEXTURE_LAYOUT_BC3 3
+#define TEXTURE_LAYOUT_BC4 4
+#define TEXTURE_LAYOUT_BC5 5
+// Texels are paged in on demand from the texture cache's backing file
+#define TEXTURE_LAYOUT_CACHED 6
+
+/* Tiled textures store each TEXTURE_TILE_DIM x TEXTURE_TILE_DIM block of texels
+ * contiguously, so a tile of RGBA8 texels fills a single 64 byte cache line and
+ * the four taps of a bilinear lookup typically hit the same line
+ */
+#define TEXTURE_TILE_DIM 4
+
+/* Compressed textures encode each TEXTURE_BLOCK_DIM x TEXTURE_BLOCK_DIM block of
+ * texels into 8 (BC1, BC4) or 16 (BC3, BC5) bytes
+ */
+#define TEXTURE_BLOCK_DIM 4
+
+/* Cached textures are paged in and out of memory in tiles of
+ * TEXTURE_CACHE_TILE_DIM x TEXTURE_CACHE_TILE_DIM RGBA8 texels (16KB)
+ */
+#define TEXTURE_CACHE_TILE_DIM 64
+
+#endif
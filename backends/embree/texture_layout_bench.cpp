@@ -0,0 +1,91 @@
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include "embree_utils.h"
+#include "render_embree_ispc.h"
+#include "util.h"
+
+/* Microbenchmark comparing the throughput of trilinear texture lookups at random uvs
+ * with the linear, tiled and compressed texture layouts.
+ * Usage: texture_layout_bench [-size <n>] [-samples <n>] [-iters <n>]
+ */
+int main(int argc, const char **argv)
+{
+    int size = 4096;
+    size_t num_samples = 1 << 24;
+    int iterations = 10;
+    const std::vector<std::string> args(argv, argv + argc);
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "-size") {
+            size = std::stoi(args[++i]);
+        } else if (args[i] == "-samples") {
+            num_samples = std::stoull(args[++i]);
+        } else if (args[i] == "-iters") {
+            iterations = std::stoi(args[++i]);
+        }
+    }
+
+    std::mt19937 rng(5);
+    std::uniform_int_distribution<int> texel_distrib(0, 255);
+    std::vector<uint8_t> texels(size_t(size) * size * 4);
+    for (auto &t : texels) {
+        t = texel_distrib(rng);
+    }
+    const Image img(texels.data(), size, size, 4, "bench");
+
+    std::uniform_real_distribution<float> uv_distrib(0.f, 1.f);
+    std::vector<float> uvs(num_samples * 2);
+    for (auto &uv : uvs) {
+        uv = uv_distrib(rng);
+    }
+    std::vector<float> results(num_samples, 0.f);
+
+    std::cout << "Sampling a " << size << "x" << size << " RGBA8 texture at " << num_samples
+              << " random uvs, " << iterations << " iterations\n";
+
+    const size_t block_size = 4096;
+    const float log2_size = std::log2(float(size));
+    const std::vector<std::pair<TextureLayout, std::string>> layouts = {
+        {TextureLayout::LINEAR, "linear"},
+        {TextureLayout::TILED, "tiled"},
+        {TextureLayout::COMPRESSED, "compressed"}};
+    for (const auto &layout : layouts) {
+        const embree::Texture2D tex(img, layout.first);
+        const embree::ISPCTexture2D ispc_tex(tex);
+        const std::string &layout_name = layout.second;
+        for (const int level : {0, 2}) {
+            const float lod = level - log2_size;
+            auto run = [&]() {
+                tbb::parallel_for(tbb::blocked_range<size_t>(0, num_samples, block_size),
+                                  [&](const tbb::blocked_range<size_t> &r) {
+                                      ispc::sample_texture(&ispc_tex,
+                                                           uvs.data() + r.begin() * 2,
+                                                           r.size(),
+                                                           lod,
+                                                           results.data() + r.begin());
+                                  });
+            };
+            // Warm up run
+            run();
+
+            using namespace std::chrono;
+            auto start = high_resolution_clock::now();
+            for (int i = 0; i < iterations; ++i) {
+                run();
+            }
+            auto end = high_resolution_clock::now();
+            const double elapsed = duration_cast<nanoseconds>(end - start).count() * 1.0e-9;
+            const double samples_per_second = num_samples * iterations / elapsed;
+            std::cout << "Layout: " << layout_name << ", mip level " << level << ": "
+                      << elapsed * 1000.0 / iterations << "ms/iter, "
+                      << pretty_print_count(samples_per_second) << "samples/s\n";
+        }
+    }
+    return 0;
+}
@@ -64,8 +64,10 @@ void RenderEmbree::initialize(const int fb_width, const int fb_height)
 #endif
 }
 
-void RenderEmbree::set_scene(const Scene &scene)
+void RenderEmbree::set_scene(const std::shared_ptr<const Scene> &in_scene)
 {
+    // The scene data is uploaded to the GPU, so we don't keep a reference to it
+    const Scene &scene = *in_scene;
     frame_id = 0;
     samples_per_pixel = scene.samples_per_pixel;
 
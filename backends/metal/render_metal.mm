@@ -62,8 +62,10 @@ void RenderMetal::initialize(const int fb_width, const int fb_height)
     }
 }
 
-void RenderMetal::set_scene(const Scene &scene)
+void RenderMetal::set_scene(const std::shared_ptr<const Scene> &in_scene)
 {
+    // The scene data is uploaded to the GPU, so we don't keep a reference to it
+    const Scene &scene = *in_scene;
     frame_id = 0;
 
     samples_per_pixel = scene.samples_per_pixel;
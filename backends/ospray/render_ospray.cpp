@@ -70,20 +70,22 @@ void RenderOSPRay::initialize(const int fb_width, const int fb_height)
     img.resize(fb_width * fb_height);
 }
 
-void RenderOSPRay::set_scene(const Scene &in_scene)
+void RenderOSPRay::set_scene(const std::shared_ptr<const Scene> &in_scene)
 {
     ospResetAccumulation(fb);
 
-    // TODO: should take scene as shared ptr
     scene = in_scene;
 
     // Linearize any sRGB textures beforehand, since we don't have fancy sRGB texture
-    // interpolation support in hardware
-    tbb::parallel_for(size_t(0), scene.textures.size(), [&](size_t i) {
-        auto &img = scene.textures[i];
-        if (img.color_space == LINEAR) {
+    // interpolation support in hardware. Linear textures are shared with the scene
+    linearized_textures.clear();
+    linearized_textures.resize(scene->textures.size());
+    tbb::parallel_for(size_t(0), scene->textures.size(), [&](size_t i) {
+        if (scene->textures[i].color_space == LINEAR) {
             return;
         }
+        auto &img = linearized_textures[i];
+        img = scene->textures[i];
         img.color_space = LINEAR;
         const int convert_channels = std::min(3, img.channels);
         tbb::parallel_for(size_t(0), size_t(img.width) * img.height, [&](size_t px) {
@@ -99,7 +101,9 @@ void RenderOSPRay::set_scene(const Scene &in_scene)
         ospRelease(t);
     }
     textures.clear();
-    for (const auto &tex : scene.textures) {
+    for (size_t i = 0; i < scene->textures.size(); ++i) {
+        const Image &tex = linearized_textures[i].img.empty() ? scene->textures[i]
+                                                              : linearized_textures[i];
         const OSPDataType data_type = tex.channels == 3 ? OSP_VEC3UC : OSP_VEC4UC;
         const int format = tex.channels == 3 ? OSP_TEXTURE_RGB8 : OSP_TEXTURE_RGBA8;
         const int filter = OSP_TEXTURE_FILTER_BILINEAR;
@@ -118,7 +122,7 @@ void RenderOSPRay::set_scene(const Scene &in_scene)
         ospRelease(m);
     }
     materials.clear();
-    for (const auto &mat : scene.materials) {
+    for (const auto &mat : scene->materials) {
         OSPMaterial m = ospNewMaterial("pathtracer", "principled");
         const int tex_handle = *reinterpret_cast<const int *>(&mat.base_color.x);
         if (IS_TEXTURED_PARAM(tex_handle)) {
@@ -153,7 +157,7 @@ void RenderOSPRay::set_scene(const Scene &in_scene)
     }
 
     std::vector<std::vector<OSPGeometry>> meshes;
-    for (const auto &mesh : scene.meshes) {
+    for (const auto &mesh : scene->meshes) {
         std::vector<OSPGeometry> mesh_geometries;
         for (const auto &geom : mesh.geometries) {
             OSPData verts_data =
@@ -180,10 +184,10 @@ void RenderOSPRay::set_scene(const Scene &in_scene)
         ospRelease(i);
     }
     instances.clear();
-    for (const auto &inst : scene.instances) {
+    for (const auto &inst : scene->instances) {
         // Make models for each geometry in the instance's mesh to set the material
         std::vector<OSPGeometricModel> geom_models;
-        const auto &pm = scene.parameterized_meshes[inst.parameterized_mesh_id];
+        const auto &pm = scene->parameterized_meshes[inst.parameterized_mesh_id];
         for (size_t i = 0; i < meshes[inst.parameterized_mesh_id].size(); ++i) {
             OSPGeometricModel gm = ospNewGeometricModel(meshes[inst.parameterized_mesh_id][i]);
             ospSetParam(gm, "material", OSP_UINT, &pm.material_ids[i]);
@@ -222,7 +226,7 @@ void RenderOSPRay::set_scene(const Scene &in_scene)
         ospRelease(l);
     }
     lights.clear();
-    for (const auto &light : scene.lights) {
+    for (const auto &light : scene->lights) {
         OSPLight l = ospNewLight("quad");
 
         const glm::vec3 color = glm::normalize(glm::vec3(light.emission));
@@ -10,7 +10,10 @@ struct RenderOSPRay : RenderBackend {
     OSPFrameBuffer fb;
     OSPWorld world;
 
-    Scene scene;
+    // OSPRay shares the scene's geometry buffers, so we keep a reference to the scene
+    std::shared_ptr<const Scene> scene;
+    // Linearized copies of the scene's sRGB textures, empty for linear textures
+    std::vector<Image> linearized_textures;
     std::vector<OSPTexture> textures;
     std::vector<OSPMaterial> materials;
     std::vector<OSPInstance> instances;
@@ -21,7 +24,7 @@ struct RenderOSPRay : RenderBackend {
 
     std::string name() override;
     void initialize(const int fb_width, const int fb_height) override;
-    void set_scene(const Scene &scene) override;
+    void set_scene(const std::shared_ptr<const Scene> &scene) override;
     RenderStats render(const glm::vec3 &pos,
                        const glm::vec3 &dir,
                        const glm::vec3 &up,
@@ -76,7 +76,7 @@ struct RenderVulkan : RenderBackend {
 
     void initialize(const int fb_width, const int fb_height) override;
 
-    void set_scene(const Scene &scene) override;
+    void set_scene(const std::shared_ptr<const Scene> &scene) override;
 
     void update_scene(const Scene &scene) override;
 
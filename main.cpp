@@ -14,6 +14,74 @@ const std::string USAGE =
     "\t-img <x> <y>           Specify the window dimensions. Defaults to 1280x720\n"
     "\t-mat-mode <MODE>       Specify the material mode, default (the default) or "
     "white_diffuse\n"
+    "\t-texture-layout <L>    Specify the texture storage layout used by the CPU backends,\n"
+    "\t                       linear (the default), tiled or compressed\n"
+    "\t-texture-cache <MB>    Page textures in on demand from disk, keeping at most\n"
+    "\t                       <MB> megabytes of texture tiles in memory (Embree)\n"
+    "\t-texture-cache-file <F>\n"
+    "\t                       Tile file for the texture cache, kept and reused by later\n"
+    "\t                       runs. Defaults to texture_cache.bin\n"
+    "\t-bvh-quality <Q>       Specify the BVH build quality used by the CPU backends,\n"
+    "\t                       low, medium (the default) or high\n"
+    "\t-bvh-compact           Build more compact BVHs, trading performance for memory\n"
+    "\t-bvh-robust            Use more robust but slower ray traversal\n"
+    "\t-compact-attributes    Store quantized uvs in the CPU backends, copying the mesh\n"
+    "\t                       data out of the scene. Only saves memory along with\n"
+    "\t                       -release-scene or -out-of-core\n"
+    "\t-shading-records       Store interleaved per-triangle shading records in the CPU\n"
+    "\t                       backends, trading memory for fewer cache misses per hit\n"
+    "\t-out-of-core <MB>      Render CRTS scenes out-of-core, loading meshes on demand from\n"
+    "\t                       the scene file and keeping at most <MB> megabytes of mesh\n"
+    "\t                       data in memory (Embree backend)\n"
+    "\t-lod <n>               Render distant instances with up to <n> simplified levels\n"
+    "\t                       of detail of each mesh, generated on first use (Embree\n"
+    "\t                       backend)\n"
+    "\t-lod-threshold <px>    Use the coarsest level whose triangle edges project to at\n"
+    "\t                       most <px> pixels. Defaults to 1\n"
+    "\t-light-sampling <S>    Pick lights by their power, or by traversing a light BVH\n"
+    "\t                       which accounts for their distance and orientation (the\n"
+    "\t                       default): power or bvh (Embree backend)\n"
+    "\t-ris <n>               Resample <n> light candidates per pixel for the direct\n"
+    "\t                       lighting at primary hits (Embree backend)\n"
+    "\t-ris-temporal          Reuse each pixel's resampled light from the previous frame\n"
+    "\t-ris-spatial           Reuse resampled lights from nearby pixels\n"
+    "\t-sampler <S>           Sample values to use for each pixel sample: independent\n"
+    "\t                       random values (the default), Owen scrambled Sobol points\n"
+    "\t                       or blue noise dithered points: lcg, sobol or blue-noise\n"
+    "\t                       (Embree backend)\n"
+    "\t-denoise               Denoise the displayed image with an edge-avoiding a-trous\n"
+    "\t                       filter guided by albedo, normal and depth (Embree backend)\n"
+    "\t-aovs                  Render AOVs for compositing and save them with each saved\n"
+    "\t                       image as a multi-layer EXR (Embree backend)\n"
+    "\t-radiance-cache        Terminate paths into a world space radiance cache after\n"
+    "\t                       their first diffuse bounce (Embree backend)\n"
+    "\t-radiance-cache-bounce <n>\n"
+    "\t                       Terminate into the cache after <n> (1 or 2) diffuse bounces\n"
+    "\t-radiance-cache-res <n>\n"
+    "\t                       Use <n> cache cells along the scene's bounding box\n"
+    "\t                       diagonal. Defaults to 512\n"
+    "\t-path-guiding          Guide indirect bounces by the incident radiance learned\n"
+    "\t                       from the rendered paths (Embree backend)\n"
+    "\t-max-depth <n>         Trace paths of up to <n> bounces, defaults to 5\n"
+    "\t                       (Embree backend)\n"
+    "\t-max-diffuse-depth <n>\n"
+    "\t                       Limit the bounces off diffuse materials to <n>\n"
+    "\t-max-specular-depth <n>\n"
+    "\t                       Limit the bounces off specular materials to <n>: any\n"
+    "\t                       transmissive or metallic (metallic > 0.5) material, smooth\n"
+    "\t                       or rough. Other materials count as diffuse\n"
+    "\t-roulette-start <n>    Start Russian roulette after <n> bounces, defaults to 3\n"
+    "\t-roulette <R>          How Russian roulette terminates paths: by their throughput\n"
+    "\t                       (the default) or by their expected contribution to the\n"
+    "\t                       pixel: throughput or efficiency\n"
+    "\t-env <file.hdr>        Light the scene with an equirectangular HDR environment map\n"
+    "\t                       (Embree backend)\n"
+    "\t-config <file.json>    Load render options from a JSON config file, options\n"
+    "\t                       given after it on the command line override the config\n"
+    "\t-release-scene         Release the application's copy of the scene data after\n"
+    "\t                       uploading it to the renderer\n"
+    "\t-memory-report <F>     Save the memory report printed after loading the scene as\n"
+    "\t                       JSON to the file <F>\n"
     "\n";
 
 const size_t max_frames = 1024;
@@ -108,8 +176,11 @@ void run_app(const std::vector<std::string> &args,
     uint32_t samples_per_pixel = 1;
     size_t camera_id = 0;
     size_t benchmark_frames = 0;
+    bool release_scene = false;
+    std::string memory_report_file;
     std::string validation_img_prefix;
     MaterialMode material_mode = MaterialMode::DEFAULT;
+    RenderParams render_params;
     for (size_t i = 1; i < args.size(); ++i) {
         if (args[i] == "-eye") {
             eye.x = std::stof(args[++i]);
@@ -141,6 +212,69 @@ void run_app(const std::vector<std::string> &args,
             if (args[++i] == "white_diffuse") {
                 material_mode = MaterialMode::WHITE_DIFFUSE;
             }
+        } else if (args[i] == "-texture-layout") {
+            render_params.texture_layout = parse_texture_layout(args[++i]);
+        } else if (args[i] == "-texture-cache") {
+            render_params.texture_cache_budget = std::stoull(args[++i]) * 1024 * 1024;
+        } else if (args[i] == "-texture-cache-file") {
+            render_params.texture_cache_file = args[++i];
+        } else if (args[i] == "-bvh-quality") {
+            render_params.bvh_quality = parse_bvh_quality(args[++i]);
+        } else if (args[i] == "-bvh-compact") {
+            render_params.bvh_compact = true;
+        } else if (args[i] == "-bvh-robust") {
+            render_params.bvh_robust = true;
+        } else if (args[i] == "-compact-attributes") {
+            render_params.compact_attributes = true;
+        } else if (args[i] == "-shading-records") {
+            render_params.shading_records = true;
+        } else if (args[i] == "-out-of-core") {
+            render_params.geometry_budget = std::stoull(args[++i]) * 1024 * 1024;
+        } else if (args[i] == "-lod") {
+            render_params.lod_levels = std::stoi(args[++i]);
+        } else if (args[i] == "-lod-threshold") {
+            render_params.lod_threshold = std::stof(args[++i]);
+        } else if (args[i] == "-light-sampling") {
+            render_params.light_sampling = parse_light_sampling(args[++i]);
+        } else if (args[i] == "-ris") {
+            render_params.ris_candidates = std::stoi(args[++i]);
+        } else if (args[i] == "-ris-temporal") {
+            render_params.ris_temporal_reuse = true;
+        } else if (args[i] == "-ris-spatial") {
+            render_params.ris_spatial_reuse = true;
+        } else if (args[i] == "-sampler") {
+            render_params.sampler = parse_sampler(args[++i]);
+        } else if (args[i] == "-denoise") {
+            render_params.denoise = true;
+        } else if (args[i] == "-aovs") {
+            render_params.aovs = true;
+        } else if (args[i] == "-radiance-cache") {
+            render_params.radiance_cache = true;
+        } else if (args[i] == "-radiance-cache-bounce") {
+            render_params.radiance_cache_bounce = std::stoi(args[++i]);
+        } else if (args[i] == "-radiance-cache-res") {
+            render_params.radiance_cache_resolution = std::stoi(args[++i]);
+        } else if (args[i] == "-path-guiding") {
+            render_params.path_guiding = true;
+        } else if (args[i] == "-max-depth") {
+            render_params.max_path_depth = std::stoi(args[++i]);
+        } else if (args[i] == "-max-diffuse-depth") {
+            render_params.max_diffuse_depth = std::stoi(args[++i]);
+        } else if (args[i] == "-max-specular-depth") {
+            render_params.max_specular_depth = std::stoi(args[++i]);
+        } else if (args[i] == "-roulette-start") {
+            render_params.roulette_start = std::stoi(args[++i]);
+        } else if (args[i] == "-roulette") {
+            render_params.roulette = parse_roulette(args[++i]);
+        } else if (args[i] == "-env") {
+            render_params.environment_map = args[++i];
+            canonicalize_path(render_params.environment_map);
+        } else if (args[i] == "-config") {
+            load_render_config(args[++i], render_params);
+        } else if (args[i] == "-release-scene") {
+            release_scene = true;
+        } else if (args[i] == "-memory-report") {
+            memory_report_file = args[++i];
         } else if (args[i] == "-benchmark-frames") {
             benchmark_frames = std::stoi(args[++i]);
         } else if (args[i][0] != '-') {
@@ -163,38 +297,89 @@ void run_app(const std::vector<std::string> &args,
     display->resize(win_width, win_height);
     renderer->initialize(win_width, win_height);
 
+    MemoryReport memory_report;
+    memory_report.end_phase("startup");
+
     std::string scene_info;
     //{
-        Scene scene(scene_file, material_mode);
-        scene.samples_per_pixel = samples_per_pixel;
+        if (render_params.geometry_budget > 0 && !renderer->supports_out_of_core()) {
+            std::cout << "Warning: " << renderer->name()
+                      << " does not support out-of-core rendering, loading the whole "
+                         "scene\n";
+            render_params.geometry_budget = 0;
+        }
+        if (render_params.lod_levels > 0 && !renderer->supports_lod()) {
+            std::cout << "Warning: " << renderer->name()
+                      << " does not support levels of detail, rendering the full meshes\n";
+            render_params.lod_levels = 0;
+        }
+        if (render_params.texture_cache_budget > 0 && !renderer->supports_texture_cache()) {
+            std::cout << "Warning: " << renderer->name()
+                      << " does not support the texture cache, loading all textures\n";
+            render_params.texture_cache_budget = 0;
+        }
+        if (render_params.aovs && !renderer->supports_aovs()) {
+            std::cout << "Warning: " << renderer->name() << " does not support AOVs\n";
+            render_params.aovs = false;
+        }
+        if (render_params.compact_attributes && !release_scene &&
+            render_params.geometry_budget == 0) {
+            std::cout << "Warning: -compact-attributes copies the mesh data, it only reduces "
+                         "memory use along with -release-scene\n";
+        }
+        auto scene = std::make_shared<Scene>(scene_file, material_mode, render_params);
+        scene->samples_per_pixel = samples_per_pixel;
+        if (!renderer->supports_instance_groups()) {
+            scene->flatten_instance_groups();
+        }
+        memory_report.end_phase("scene load");
 
         std::stringstream ss;
         ss << "Scene '" << scene_file << "':\n"
-           << "# Unique Triangles: " << pretty_print_count(scene.unique_tris()) << "\n"
-           << "# Total Triangles: " << pretty_print_count(scene.total_tris()) << "\n"
-           << "# Geometries: " << scene.num_geometries() << "\n"
-           << "# Meshes: " << scene.meshes.size() << "\n"
-           << "# Parameterized Meshes: " << scene.parameterized_meshes.size() << "\n"
-           << "# Instances: " << scene.instances.size() << "\n"
-           << "# Materials: " << scene.materials.size() << "\n"
-           << "# Textures: " << scene.textures.size() << "\n"
-           << "# Lights: " << scene.lights.size() << "\n"
-           << "# Cameras: " << scene.cameras.size() << "\n"
-           << "# Camera Type: " << scene.camParams.type << "\n"
-           << "# Samples per Pixel: " << scene.samples_per_pixel;
+           << "# Unique Triangles: " << pretty_print_count(scene->unique_tris()) << "\n"
+           << "# Total Triangles: " << pretty_print_count(scene->total_tris()) << "\n"
+           << "# Geometries: " << scene->num_geometries() << "\n"
+           << "# Meshes: " << scene->meshes.size() << "\n"
+           << "# Parameterized Meshes: " << scene->parameterized_meshes.size() << "\n"
+           << "# Instances: " << scene->instances.size() << "\n"
+           << "# Instance Groups: " << scene->instance_groups.size() << "\n"
+           << "# Group Instances: " << scene->group_instances.size() << "\n"
+           << "# Materials: " << scene->materials.size() << "\n"
+           << "# Textures: " << scene->textures.size() << "\n"
+           << "# Lights: " << scene->lights.size() << "\n"
+           << "# Cameras: " << scene->cameras.size() << "\n"
+           << "# Camera Type: " << scene->camParams.type << "\n"
+           << "# Samples per Pixel: " << scene->samples_per_pixel;
 
         scene_info = ss.str();
         std::cout << scene_info << "\n";
 
-        renderer->set_scene(scene);
-
-        if (!got_camera_args && !scene.cameras.empty() && camera_id <= scene.cameras.size()) {
-            eye = scene.cameras[camera_id].position;
-            camView = glm::normalize(scene.cameras[camera_id].center -
-                                     scene.cameras[camera_id].position);
-            up = scene.cameras[camera_id].up;
-            fov_y = scene.cameras[camera_id].fov_y;
-            scene.camParams.cameraFOVAngle = fov_y * M_PI / 180.f;
+        /* Hand the scene over to the renderer and keep just the parameters we need, the
+         * backends which need the scene data keep their own reference to it
+         */
+        if (release_scene) {
+            auto params = std::make_shared<Scene>(scene->parameters());
+            renderer->take_scene(std::move(scene));
+            scene = params;
+        } else {
+            renderer->set_scene(scene);
+        }
+        memory_report.end_phase("renderer set_scene");
+
+        if (!got_camera_args && !scene->cameras.empty() &&
+            camera_id <= scene->cameras.size()) {
+            eye = scene->cameras[camera_id].position;
+            camView = glm::normalize(scene->cameras[camera_id].center -
+                                     scene->cameras[camera_id].position);
+            up = scene->cameras[camera_id].up;
+            fov_y = scene->cameras[camera_id].fov_y;
+            scene->camParams.cameraFOVAngle = fov_y * M_PI / 180.f;
+        }
+        scene->memory_report(memory_report);
+        renderer->memory_report(memory_report);
+        std::cout << memory_report.to_string() << "\n";
+        if (!memory_report_file.empty()) {
+            memory_report.save_json(memory_report_file);
         }
     //}
 
@@ -218,7 +403,7 @@ void run_app(const std::vector<std::string> &args,
     while (!done) {
         SDL_Event event;
         done = process_SDL_Event(
-            event, io, camera, scene, window, renderer, display, camera_changed, prev_mouse);
+            event, io, camera, *scene, window, renderer, display, camera_changed, prev_mouse);
 
         if (camera_changed) {
             frame_id = 0;
@@ -252,6 +437,13 @@ void run_app(const std::vector<std::string> &args,
                            4,
                            renderer->img.data(),
                            4 * win_width);
+            if (render_params.aovs) {
+                const std::string exr_output =
+                    image_output.substr(0, image_output.rfind('.')) + ".exr";
+                std::cout << "AOVs saved to " << image_dir + exr_output << "\n";
+                write_exr(
+                    image_dir + exr_output, win_width, win_height, renderer->read_aovs());
+            }
         }
         if (!validation_img_prefix.empty()) {
             const std::string img_name = validation_img_prefix + render_plugin->get_name() +
@@ -281,6 +473,10 @@ void run_app(const std::vector<std::string> &args,
                 std::cout << "Rays per-second " << rays_per_second / frame_id << " Ray/s ("
                           << rays_per_sec << "Ray/s)\n";
             }
+            if (stats.streamed_loads > 0) {
+                std::cout << "Streamed meshes: " << stats.streamed_loads << " loads, "
+                          << stats.streamed_evictions << " evictions\n";
+            }
             done = true;
         }
 
@@ -298,6 +494,11 @@ void run_app(const std::vector<std::string> &args,
             const std::string rays_per_sec = pretty_print_count(rays_per_second / frame_id);
             ImGui::Text("Rays per-second: %sRay/s", rays_per_sec.c_str());
         }
+        if (stats.streamed_loads > 0) {
+            ImGui::Text("Streamed Meshes: %llu loads, %llu evictions",
+                        (unsigned long long)stats.streamed_loads,
+                        (unsigned long long)stats.streamed_evictions);
+        }
 
         ImGui::Text("Total Application Time: %.3f ms/frame (%.1f FPS)",
                     1000.0f / ImGui::GetIO().Framerate,
@@ -320,10 +521,10 @@ void run_app(const std::vector<std::string> &args,
             save_image = true;
         }
 
-        if (camParamsDropdown(scene.camParams))
+        if (camParamsDropdown(scene->camParams))
         {
-            renderer->update_scene(scene);
-            fov_y = scene.camParams.cameraFOVAngle * 180.f / M_PI;
+            renderer->update_scene(*scene);
+            fov_y = scene->camParams.cameraFOVAngle * 180.f / M_PI;
             camera_changed = true;
         }
             
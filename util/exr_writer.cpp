@@ -0,0 +1,148 @@
+#include "exr_writer.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+// See https://openexr.com/en/latest/OpenEXRFileLayout.html, all values are little endian
+static const int32_t EXR_MAGIC = 20000630;
+static const int32_t EXR_VERSION = 2;
+// Set in the version field if any attribute or channel name is longer than 31 bytes
+static const int32_t EXR_LONG_NAMES = 0x400;
+static const int32_t EXR_PIXEL_TYPE_FLOAT = 2;
+static const uint8_t EXR_NO_COMPRESSION = 0;
+static const uint8_t EXR_INCREASING_Y = 0;
+
+struct ExrChannel {
+    std::string name;
+    const ImageLayer *layer;
+    size_t channel;
+};
+
+template <typename T>
+static void append(std::vector<char> &buf, const T &v)
+{
+    const char *bytes = reinterpret_cast<const char *>(&v);
+    buf.insert(buf.end(), bytes, bytes + sizeof(T));
+}
+
+static void append(std::vector<char> &buf, const std::string &str)
+{
+    buf.insert(buf.end(), str.begin(), str.end());
+    buf.push_back('\0');
+}
+
+static void append_attribute(std::vector<char> &buf,
+                             const std::string &name,
+                             const std::string &type,
+                             const std::vector<char> &value)
+{
+    append(buf, name);
+    append(buf, type);
+    append(buf, static_cast<int32_t>(value.size()));
+    buf.insert(buf.end(), value.begin(), value.end());
+}
+
+static std::vector<char> box2i(const int width, const int height)
+{
+    std::vector<char> box;
+    append(box, int32_t(0));
+    append(box, int32_t(0));
+    append(box, int32_t(width - 1));
+    append(box, int32_t(height - 1));
+    return box;
+}
+
+void write_exr(const std::string &file,
+               const int width,
+               const int height,
+               const std::vector<ImageLayer> &layers)
+{
+    // The channels must be stored sorted by name
+    std::vector<ExrChannel> channels;
+    bool long_names = false;
+    for (const auto &l : layers) {
+        if (l.data.size() != size_t(width) * height * l.channels.size()) {
+            throw std::runtime_error("Image layer '" + l.name + "' has the wrong size");
+        }
+        for (size_t c = 0; c < l.channels.size(); ++c) {
+            const std::string name =
+                l.name.empty() ? l.channels[c] : l.name + "." + l.channels[c];
+            long_names = long_names || name.size() > 31;
+            channels.push_back(ExrChannel{name, &l, c});
+        }
+    }
+    std::sort(channels.begin(), channels.end(), [](const ExrChannel &a, const ExrChannel &b) {
+        return a.name < b.name;
+    });
+
+    std::vector<char> header;
+    append(header, EXR_MAGIC);
+    append(header, EXR_VERSION | (long_names ? EXR_LONG_NAMES : 0));
+
+    std::vector<char> chlist;
+    for (const auto &c : channels) {
+        append(chlist, c.name);
+        append(chlist, EXR_PIXEL_TYPE_FLOAT);
+        // pLinear and reserved bytes
+        append(chlist, uint32_t(0));
+        // x and y sampling
+        append(chlist, int32_t(1));
+        append(chlist, int32_t(1));
+    }
+    chlist.push_back('\0');
+    append_attribute(header, "channels", "chlist", chlist);
+    append_attribute(header, "compression", "compression", {char(EXR_NO_COMPRESSION)});
+    append_attribute(header, "dataWindow", "box2i", box2i(width, height));
+    append_attribute(header, "displayWindow", "box2i", box2i(width, height));
+    append_attribute(header, "lineOrder", "lineOrder", {char(EXR_INCREASING_Y)});
+
+    std::vector<char> value;
+    append(value, 1.f);
+    append_attribute(header, "pixelAspectRatio", "float", value);
+    value.clear();
+    append(value, 0.f);
+    append(value, 0.f);
+    append_attribute(header, "screenWindowCenter", "v2f", value);
+    value.clear();
+    append(value, 1.f);
+    append_attribute(header, "screenWindowWidth", "float", value);
+    header.push_back('\0');
+
+    // Uncompressed files store one scanline per chunk, each chunk is the scanline's y
+    // coordinate and data size followed by each channel's row of pixels
+    const size_t line_bytes = channels.size() * width * sizeof(float);
+    const size_t chunk_bytes = 2 * sizeof(int32_t) + line_bytes;
+    const uint64_t first_chunk = header.size() + height * sizeof(uint64_t);
+    for (int y = 0; y < height; ++y) {
+        append(header, uint64_t(first_chunk + y * chunk_bytes));
+    }
+
+    std::ofstream fout(file.c_str(), std::ios::binary);
+    if (!fout) {
+        throw std::runtime_error("Failed to open " + file + " for writing");
+    }
+    fout.write(header.data(), header.size());
+
+    std::vector<char> chunk(chunk_bytes);
+    for (int y = 0; y < height; ++y) {
+        const int32_t line_y = y;
+        const int32_t data_size = line_bytes;
+        std::memcpy(chunk.data(), &line_y, sizeof(int32_t));
+        std::memcpy(chunk.data() + sizeof(int32_t), &data_size, sizeof(int32_t));
+        float *line = reinterpret_cast<float *>(chunk.data() + 2 * sizeof(int32_t));
+        for (const auto &c : channels) {
+            const size_t stride = c.layer->channels.size();
+            const float *row = c.layer->data.data() + size_t(y) * width * stride;
+            for (int x = 0; x < width; ++x) {
+                line[x] = row[x * stride + c.channel];
+            }
+            line += width;
+        }
+        fout.write(chunk.data(), chunk.size());
+    }
+    if (!fout) {
+        throw std::runtime_error("Failed to write " + file);
+    }
+}
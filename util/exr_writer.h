@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// A layer of a multi-layer float image, with the channels of each pixel interleaved
+struct ImageLayer {
+    // The unnamed layer is the image's main layer, e.g. its R, G and B channels
+    std::string name;
+    std::vector<std::string> channels;
+    std::vector<float> data;
+};
+
+/* Write the layers to an uncompressed scanline OpenEXR file with 32-bit float channels.
+ * Each channel is named "<layer>.<channel>", or just "<channel>" for the unnamed layer,
+ * following the multi-layer naming convention compositing tools expect. Throws if the
+ * file can't be written
+ */
+void write_exr(const std::string &file,
+               const int width,
+               const int height,
+               const std::vector<ImageLayer> &layers);
@@ -1,6 +1,10 @@
 #include "material.h"
+#include <algorithm>
+#include <fstream>
 #include <stdexcept>
+#include <sys/stat.h>
 #include "stb_image.h"
+#include "util.h"
 
 Image::Image(const std::string &file, const std::string &name, ColorSpace color_space)
     : name(name), color_space(color_space)
@@ -31,3 +35,137 @@ Image::Image(const uint8_t *buf,
 {
 }
 
+// Read the byte range of the file, to the end of the file if bytes is 0
+static std::vector<uint8_t> read_file_range(const std::string &file,
+                                            const uint64_t offset,
+                                            uint64_t bytes)
+{
+    std::ifstream in(file, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Failed to open " + file);
+    }
+    if (bytes == 0) {
+        in.seekg(0, std::ios::end);
+        bytes = uint64_t(in.tellg()) - offset;
+    }
+    std::vector<uint8_t> buf(bytes);
+    in.seekg(offset);
+    in.read(reinterpret_cast<char *>(buf.data()), bytes);
+    if (!in) {
+        throw std::runtime_error("Failed to read " + file);
+    }
+    return buf;
+}
+
+Image Image::encoded_file(const std::string &file,
+                          const std::string &name,
+                          ColorSpace color_space,
+                          uint64_t offset,
+                          uint64_t bytes)
+{
+    Image img;
+    img.name = name;
+    img.color_space = color_space;
+    img.file = file;
+    img.file_offset = offset;
+    img.file_bytes = bytes;
+
+    int n = 0;
+    bool valid = false;
+    if (bytes == 0) {
+        valid = stbi_info(file.c_str(), &img.width, &img.height, &n);
+    } else {
+        const std::vector<uint8_t> buf = read_file_range(file, offset, bytes);
+        valid = stbi_info_from_memory(buf.data(), buf.size(), &img.width, &img.height, &n);
+    }
+    if (!valid) {
+        throw std::runtime_error("Failed to load " + file);
+    }
+    img.channels = 4;
+    return img;
+}
+
+Image Image::encoded_buffer(std::vector<uint8_t> encoded,
+                            const std::string &name,
+                            ColorSpace color_space,
+                            bool flip_y)
+{
+    Image img;
+    img.name = name;
+    img.color_space = color_space;
+    img.flip_y = flip_y;
+
+    int n = 0;
+    if (!stbi_info_from_memory(
+            encoded.data(), encoded.size(), &img.width, &img.height, &n)) {
+        throw std::runtime_error("Failed to load " + name);
+    }
+    img.channels = 4;
+    img.encoded = std::move(encoded);
+    return img;
+}
+
+bool Image::is_encoded() const
+{
+    return img.empty() && (!file.empty() || !encoded.empty());
+}
+
+Image Image::decode() const
+{
+    const std::vector<uint8_t> file_data =
+        encoded.empty() ? read_file_range(file, file_offset, file_bytes)
+                        : std::vector<uint8_t>();
+    const std::vector<uint8_t> &src = encoded.empty() ? file_data : encoded;
+
+    int x, y, n;
+    uint8_t *data = stbi_load_from_memory(src.data(), src.size(), &x, &y, &n, 4);
+    if (!data) {
+        throw std::runtime_error("Failed to decode " + name);
+    }
+    Image decoded(data, x, y, 4, name, color_space);
+    stbi_image_free(data);
+
+    // Flip the rows ourselves, stb_image's flip setting is global and shared by the
+    // threads decoding textures in parallel
+    if (flip_y) {
+        const size_t row_bytes = size_t(x) * 4;
+        for (int r = 0; r < y / 2; ++r) {
+            std::swap_ranges(decoded.img.begin() + r * row_bytes,
+                             decoded.img.begin() + (r + 1) * row_bytes,
+                             decoded.img.begin() + (y - r - 1) * row_bytes);
+        }
+    }
+    return decoded;
+}
+
+std::string Image::key() const
+{
+    std::string key;
+    if (!file.empty()) {
+        struct stat st = {};
+        stat(file.c_str(), &st);
+        key = "file:" + file + ":" + std::to_string(file_offset) + ":" +
+              std::to_string(file_bytes) + ":" + std::to_string(st.st_size) + ":" +
+              std::to_string(st.st_mtime);
+    } else if (!encoded.empty()) {
+        key = "encoded:" + std::to_string(hash_bytes(encoded.data(), encoded.size())) +
+              ":" + std::to_string(encoded.size());
+    } else {
+        key = "texels:" + std::to_string(hash_bytes(img.data(), img.size())) + ":" +
+              std::to_string(width) + "x" + std::to_string(height) + "x" +
+              std::to_string(channels);
+    }
+    return key + (flip_y ? ":flip" : "") + (color_space == SRGB ? ":srgb" : ":linear");
+}
+
+HDRImage::HDRImage(const std::string &file)
+{
+    int channels = 0;
+    float *data = stbi_loadf(file.c_str(), &width, &height, &channels, 3);
+    if (!data) {
+        throw std::runtime_error("Failed to load " + file);
+    }
+    img = std::vector<float>(data, data + width * height * 3);
+    stbi_image_free(data);
+}
+
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <vector>
@@ -16,6 +17,18 @@ struct Image {
     std::vector<uint8_t> img;
     ColorSpace color_space = LINEAR;
 
+    /* Textures paged in by the texture cache are left encoded until the cache decodes
+     * them. Their img is empty and the encoded image is read from the byte range of the
+     * source file, or from encoded if it's not in a file of its own. Their size is read
+     * from the image header and they're decoded to RGBA8
+     */
+    std::string file;
+    uint64_t file_offset = 0;
+    // The size of the encoded image in the file, 0 if it's the whole file
+    uint64_t file_bytes = 0;
+    std::vector<uint8_t> encoded;
+    bool flip_y = true;
+
     Image(const std::string &file, const std::string &name, ColorSpace color_space = LINEAR);
     Image(const uint8_t *buf,
           int width,
@@ -24,6 +37,41 @@ struct Image {
           const std::string &name,
           ColorSpace color_space = LINEAR);
     Image() = default;
+
+    // Make an encoded image from the file, or from the byte range of it
+    static Image encoded_file(const std::string &file,
+                              const std::string &name,
+                              ColorSpace color_space = LINEAR,
+                              uint64_t offset = 0,
+                              uint64_t bytes = 0);
+
+    // Make an encoded image from the buffer, flip_y flips it vertically when decoding
+    static Image encoded_buffer(std::vector<uint8_t> encoded,
+                                const std::string &name,
+                                ColorSpace color_space = LINEAR,
+                                bool flip_y = true);
+
+    bool is_encoded() const;
+
+    // Decode the encoded image into a new image with its texels
+    Image decode() const;
+
+    /* A key identifying the image's texels. Encoded images are identified by their
+     * source so they don't need to be decoded, file sources include the file's size and
+     * modification time so the key changes if the file is modified
+     */
+    std::string key() const;
+};
+
+// Linear RGB floating point image, e.g. an HDR environment map
+struct HDRImage {
+    int width = -1;
+    int height = -1;
+    std::vector<float> img;
+
+    // Load a Radiance .hdr image
+    HDRImage(const std::string &file);
+    HDRImage() = default;
 };
 
 struct DisneyMaterial {
@@ -0,0 +1,90 @@
+#include "memory_report.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+#include "json.hpp"
+#include "util.h"
+
+void MemoryReport::add(const std::string &component, const size_t bytes)
+{
+    components.emplace_back(component, bytes);
+}
+
+void MemoryReport::end_phase(const std::string &phase)
+{
+    phases.emplace_back(phase, peak_rss());
+}
+
+size_t MemoryReport::total_bytes() const
+{
+    size_t total = 0;
+    for (const auto &c : components) {
+        total += c.second;
+    }
+    return total;
+}
+
+std::string MemoryReport::to_string() const
+{
+    std::stringstream ss;
+    ss << "Memory:\n";
+    for (const auto &c : components) {
+        ss << "  " << c.first << ": " << pretty_print_count(c.second) << "B\n";
+    }
+    ss << "  Total: " << pretty_print_count(total_bytes()) << "B\n"
+       << "Peak RSS:";
+    for (const auto &p : phases) {
+        ss << "\n  " << p.first << ": " << pretty_print_count(p.second) << "B";
+    }
+    return ss.str();
+}
+
+void MemoryReport::save_json(const std::string &file) const
+{
+    using json = nlohmann::json;
+    json report;
+    report["components"] = json::array();
+    for (const auto &c : components) {
+        report["components"].push_back({{"name", c.first}, {"bytes", c.second}});
+    }
+    report["total_bytes"] = total_bytes();
+    report["phases"] = json::array();
+    for (const auto &p : phases) {
+        report["phases"].push_back({{"name", p.first}, {"peak_rss_bytes", p.second}});
+    }
+
+    std::ofstream fout(file.c_str());
+    if (!fout) {
+        throw std::runtime_error("Failed to open memory report file " + file);
+    }
+    fout << report.dump(4) << "\n";
+}
+
+size_t peak_rss()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    // macOS reports the max RSS in bytes, Linux in kilobytes
+    return usage.ru_maxrss;
+#else
+    return size_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
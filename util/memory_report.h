@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* Breakdown of the memory used by the components of the scene and renderer, along with
+ * the peak resident set size of the process at the end of each load phase
+ */
+struct MemoryReport {
+    // Bytes used by each component, named as "<owner>/<component>", e.g. "scene/vertices"
+    std::vector<std::pair<std::string, size_t>> components;
+    // Peak resident set size in bytes at the end of each phase
+    std::vector<std::pair<std::string, size_t>> phases;
+
+    void add(const std::string &component, const size_t bytes);
+
+    // Record the peak resident set size so far as that of the phase
+    void end_phase(const std::string &phase);
+
+    size_t total_bytes() const;
+
+    std::string to_string() const;
+
+    /* Save the report as JSON, with the components and phases as arrays in the order
+     * they were added: {"components": [{"name": string, "bytes": number}, ...],
+     * "total_bytes": number, "phases": [{"name": string, "peak_rss_bytes": number}, ...]}
+     */
+    void save_json(const std::string &file) const;
+};
+
+// Get the peak resident set size of the process in bytes, or 0 if it's not available
+size_t peak_rss();
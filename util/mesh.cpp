@@ -1,6 +1,8 @@
 #include "mesh.h"
 #include <algorithm>
+#include <limits>
 #include <numeric>
+#include "phmap.h"
 
 size_t Geometry::num_tris() const
 {
@@ -17,6 +19,132 @@ size_t Mesh::num_tris() const
         });
 }
 
+static float average_edge_length(const std::vector<Geometry> &geometries)
+{
+    double total_length = 0.0;
+    size_t num_edges = 0;
+    for (const auto &g : geometries) {
+        for (const auto &tri : g.indices) {
+            for (int i = 0; i < 3; ++i) {
+                total_length +=
+                    glm::length(g.vertices[tri[(i + 1) % 3]] - g.vertices[tri[i]]);
+            }
+        }
+        num_edges += g.indices.size() * 3;
+    }
+    return num_edges > 0 ? total_length / num_edges : 0.f;
+}
+
+/* Simplify the geometry by clustering its vertices on a grid with the cell size, the
+ * vertices in each cell are replaced by their average and triangles which collapse are
+ * removed
+ */
+static Geometry cluster_vertices(const Geometry &geom, const float cell_size)
+{
+    glm::vec3 bounds_min(std::numeric_limits<float>::infinity());
+    for (const auto &v : geom.vertices) {
+        bounds_min = glm::min(bounds_min, v);
+    }
+
+    Geometry simplified;
+    std::vector<uint32_t> cluster_sizes;
+    std::vector<uint32_t> vertex_clusters(geom.vertices.size());
+    phmap::flat_hash_map<uint64_t, uint32_t> clusters;
+    for (size_t i = 0; i < geom.vertices.size(); ++i) {
+        const glm::uvec3 cell(
+            glm::min(glm::floor((geom.vertices[i] - bounds_min) / cell_size),
+                     glm::vec3((1 << 21) - 1)));
+        const uint64_t key = uint64_t(cell.x) | (uint64_t(cell.y) << 21) |
+                             (uint64_t(cell.z) << 42);
+        auto fnd = clusters.find(key);
+        uint32_t cluster = 0;
+        if (fnd == clusters.end()) {
+            cluster = simplified.vertices.size();
+            clusters[key] = cluster;
+            simplified.vertices.push_back(glm::vec3(0.f));
+            if (!geom.normals.empty()) {
+                simplified.normals.push_back(glm::vec3(0.f));
+            }
+            if (!geom.uvs.empty()) {
+                simplified.uvs.push_back(glm::vec2(0.f));
+            }
+            cluster_sizes.push_back(0);
+        } else {
+            cluster = fnd->second;
+        }
+        vertex_clusters[i] = cluster;
+
+        simplified.vertices[cluster] += geom.vertices[i];
+        if (!geom.normals.empty()) {
+            simplified.normals[cluster] += geom.normals[i];
+        }
+        if (!geom.uvs.empty()) {
+            simplified.uvs[cluster] += geom.uvs[i];
+        }
+        ++cluster_sizes[cluster];
+    }
+
+    for (size_t i = 0; i < simplified.vertices.size(); ++i) {
+        simplified.vertices[i] /= cluster_sizes[i];
+        if (!simplified.normals.empty() && glm::length(simplified.normals[i]) > 0.f) {
+            simplified.normals[i] = glm::normalize(simplified.normals[i]);
+        }
+        if (!simplified.uvs.empty()) {
+            simplified.uvs[i] /= cluster_sizes[i];
+        }
+    }
+    // Pad the vertex buffer for renderers which need it, as the loaders do
+    simplified.vertices.reserve(simplified.vertices.size() + 1);
+
+    for (const auto &tri : geom.indices) {
+        const glm::uvec3 t(
+            vertex_clusters[tri.x], vertex_clusters[tri.y], vertex_clusters[tri.z]);
+        if (t.x != t.y && t.x != t.z && t.y != t.z) {
+            simplified.indices.push_back(t);
+        }
+    }
+    return simplified;
+}
+
+float Mesh::average_edge_length() const
+{
+    return ::average_edge_length(geometries);
+}
+
+std::vector<Geometry> Mesh::generate_lod(const float cell_size) const
+{
+    std::vector<Geometry> level;
+    for (const auto &g : geometries) {
+        Geometry simplified = cluster_vertices(g, cell_size);
+        if (simplified.indices.empty()) {
+            simplified = g;
+        }
+        level.push_back(std::move(simplified));
+    }
+    return level;
+}
+
+Mesh StreamedMesh::load() const
+{
+    Geometry geom;
+    // Reserve an extra vertex so renderers which need the vertex buffer padded can
+    // share it instead of making a padded copy
+    geom.vertices.reserve(num_vertices + 1);
+    geom.vertices.assign(vertices, vertices + num_vertices);
+    geom.indices.assign(indices, indices + num_tris);
+    geom.uvs.assign(uvs, uvs + num_uvs);
+
+    Mesh mesh;
+    mesh.geometries.push_back(std::move(geom));
+    return mesh;
+}
+
+size_t StreamedMesh::nbytes() const
+{
+    return num_vertices * sizeof(glm::vec3) + num_tris * sizeof(glm::uvec3) +
+           num_uvs * sizeof(glm::vec2);
+}
+
 ParameterizedMesh::ParameterizedMesh(size_t mesh_id, const std::vector<uint32_t> &material_ids)
     : mesh_id(mesh_id), material_ids(material_ids)
 {
@@ -26,3 +154,8 @@ Instance::Instance(const glm::mat4 &transform, size_t parameterized_mesh_id)
     : transform(transform), parameterized_mesh_id(parameterized_mesh_id)
 {
 }
+
+GroupInstance::GroupInstance(const glm::mat4 &transform, size_t group_id)
+    : transform(transform), group_id(group_id)
+{
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
 #include <glm/glm.hpp>
 
@@ -19,6 +20,38 @@ struct Mesh {
     Mesh() = default;
 
     size_t num_tris() const;
+
+    // Average triangle edge length of the mesh's geometries
+    float average_edge_length() const;
+
+    /* Generate a simplified level of detail by clustering the mesh's vertices on a grid
+     * with the cell size, doubling the cell size roughly quarters the triangle count. The
+     * level has the same geometries as the mesh so the mesh's parameterizations apply to
+     * it, geometries which would collapse entirely are kept at full resolution
+     */
+    std::vector<Geometry> generate_lod(const float cell_size) const;
+};
+
+/* A mesh with a single geometry whose data is left in a memory mapped scene file, for
+ * out-of-core rendering of scenes which don't fit in memory. The buffers are tightly
+ * packed, the bounds are computed at load time so the mesh can be placed in the scene
+ * without loading its data
+ */
+struct StreamedMesh {
+    const glm::vec3 *vertices = nullptr;
+    size_t num_vertices = 0;
+    const glm::uvec3 *indices = nullptr;
+    size_t num_tris = 0;
+    const glm::vec2 *uvs = nullptr;
+    size_t num_uvs = 0;
+    glm::vec3 bounds_min = glm::vec3(0.f);
+    glm::vec3 bounds_max = glm::vec3(0.f);
+
+    // Copy the mesh data out of the file
+    Mesh load() const;
+
+    // Size in bytes of the mesh data once loaded
+    size_t nbytes() const;
 };
 
 /* A parameterized mesh is a combination of a mesh containing the geometries
@@ -45,3 +78,21 @@ struct Instance {
 
     Instance() = default;
 };
+
+/* An instance group is a set of instances which can itself be instanced, for two-level
+ * instancing. The instances in the group are placed relative to the group
+ */
+struct InstanceGroup {
+    std::vector<Instance> instances;
+};
+
+/* A group instance places an instance group at some location in the scene
+ */
+struct GroupInstance {
+    glm::mat4 transform;
+    size_t group_id;
+
+    GroupInstance(const glm::mat4 &transform, size_t group_id);
+
+    GroupInstance() = default;
+};
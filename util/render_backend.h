@@ -1,12 +1,18 @@
 #pragma once
 
+#include <cstdint>
+#include <memory>
 #include <vector>
+#include "exr_writer.h"
 #include "scene.h"
 #include <glm/glm.hpp>
 
 struct RenderStats {
     float render_time = 0;
     float rays_per_second = 0;
+    // Total meshes loaded and evicted by backends streaming out-of-core scenes
+    uint64_t streamed_loads = 0;
+    uint64_t streamed_evictions = 0;
 };
 
 struct RenderBackend {
@@ -19,8 +25,79 @@ struct RenderBackend {
 
     virtual void initialize(const int fb_width, const int fb_height) = 0;
 
-    // TODO Probably should take the scene through a shared_ptr
-    virtual void set_scene(const Scene &scene) = 0;
+    /* Upload the scene to the renderer. The scene is shared with the application and
+     * must not be modified by the backend. Backends which render directly from the
+     * scene's buffers keep a reference to it, while backends which upload the data to
+     * the GPU can drop it after uploading so the CPU-side data can be released
+     */
+    virtual void set_scene(const std::shared_ptr<const Scene> &scene) = 0;
+
+    /* Upload the scene to the renderer, handing it over to the backend. The application
+     * gives up its reference so the backend is free to modify the scene, e.g. backends
+     * which keep a reference to the scene's geometry release its shading data once
+     * they've made their own copy of it. Defaults to set_scene
+     */
+    virtual void take_scene(std::shared_ptr<Scene> scene)
+    {
+        set_scene(scene);
+    }
+
+    /* Whether the backend can render the scene's instance groups directly. The scene's
+     * instance groups are flattened into its instances before calling set_scene for
+     * backends which don't support them
+     */
+    virtual bool supports_instance_groups()
+    {
+        return false;
+    }
+
+    /* Whether the backend can render out-of-core scenes, whose meshes are left in the
+     * scene file as streamed meshes. The whole scene is loaded for backends which don't
+     */
+    virtual bool supports_out_of_core()
+    {
+        return false;
+    }
+
+    /* Whether the backend renders the meshes' levels of detail. Levels of detail are only
+     * generated for backends which do
+     */
+    virtual bool supports_lod()
+    {
+        return false;
+    }
+
+    /* Whether the backend pages textures in through the texture cache. The scene's
+     * textures are left encoded for backends which do, and loaded for those which don't
+     */
+    virtual bool supports_texture_cache()
+    {
+        return false;
+    }
+
+    /* Whether the backend renders arbitrary output variables (AOVs) along with the image.
+     * The AOVs are only requested from backends which do
+     */
+    virtual bool supports_aovs()
+    {
+        return false;
+    }
+
+    /* Read back the accumulated image and AOVs as float layers, the image's color is the
+     * unnamed layer. Only valid after rendering a frame with the aovs render param set
+     */
+    virtual std::vector<ImageLayer> read_aovs()
+    {
+        return std::vector<ImageLayer>();
+    }
+
+    /* Add the memory used by the backend to the report. Backends should add their
+     * scene data, acceleration structures and textures to the default framebuffer entry
+     */
+    virtual void memory_report(MemoryReport &report)
+    {
+        report.add("framebuffer", img.size() * sizeof(uint32_t));
+    }
 
     // light-weight version of set_scene(), when we want to update some params
     virtual void update_scene(const Scene &scene) = 0;
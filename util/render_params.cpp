@@ -0,0 +1,158 @@
+#include "render_params.h"
+#include <fstream>
+#include <stdexcept>
+#include "json.hpp"
+
+TextureLayout parse_texture_layout(const std::string &name)
+{
+    if (name == "linear") {
+        return TextureLayout::LINEAR;
+    } else if (name == "tiled") {
+        return TextureLayout::TILED;
+    } else if (name == "compressed") {
+        return TextureLayout::COMPRESSED;
+    }
+    throw std::runtime_error("Invalid texture layout '" + name + "'");
+}
+
+BVHQuality parse_bvh_quality(const std::string &name)
+{
+    if (name == "low") {
+        return BVHQuality::LOW;
+    } else if (name == "medium") {
+        return BVHQuality::MEDIUM;
+    } else if (name == "high") {
+        return BVHQuality::HIGH;
+    }
+    throw std::runtime_error("Invalid BVH quality '" + name + "'");
+}
+
+LightSampling parse_light_sampling(const std::string &name)
+{
+    if (name == "power") {
+        return LightSampling::POWER;
+    } else if (name == "bvh") {
+        return LightSampling::BVH;
+    }
+    throw std::runtime_error("Invalid light sampling '" + name + "'");
+}
+
+SamplerType parse_sampler(const std::string &name)
+{
+    if (name == "lcg") {
+        return SamplerType::LCG;
+    } else if (name == "sobol") {
+        return SamplerType::SOBOL;
+    } else if (name == "blue-noise") {
+        return SamplerType::BLUE_NOISE;
+    }
+    throw std::runtime_error("Invalid sampler '" + name + "'");
+}
+
+RouletteMode parse_roulette(const std::string &name)
+{
+    if (name == "throughput") {
+        return RouletteMode::THROUGHPUT;
+    } else if (name == "efficiency") {
+        return RouletteMode::EFFICIENCY;
+    }
+    throw std::runtime_error("Invalid roulette mode '" + name + "'");
+}
+
+void load_render_config(const std::string &file, RenderParams &params)
+{
+    using json = nlohmann::json;
+    std::ifstream fin(file.c_str());
+    if (!fin) {
+        throw std::runtime_error("Failed to open render config " + file);
+    }
+    json config = json::parse(fin);
+
+    if (config.find("texture_layout") != config.end()) {
+        params.texture_layout =
+            parse_texture_layout(config["texture_layout"].get<std::string>());
+    }
+    if (config.find("texture_cache_mb") != config.end()) {
+        params.texture_cache_budget = config["texture_cache_mb"].get<size_t>() * 1024 * 1024;
+    }
+    if (config.find("texture_cache_file") != config.end()) {
+        params.texture_cache_file = config["texture_cache_file"].get<std::string>();
+    }
+    if (config.find("bvh_quality") != config.end()) {
+        params.bvh_quality = parse_bvh_quality(config["bvh_quality"].get<std::string>());
+    }
+    if (config.find("bvh_compact") != config.end()) {
+        params.bvh_compact = config["bvh_compact"].get<bool>();
+    }
+    if (config.find("bvh_robust") != config.end()) {
+        params.bvh_robust = config["bvh_robust"].get<bool>();
+    }
+    if (config.find("compact_attributes") != config.end()) {
+        params.compact_attributes = config["compact_attributes"].get<bool>();
+    }
+    if (config.find("shading_records") != config.end()) {
+        params.shading_records = config["shading_records"].get<bool>();
+    }
+    if (config.find("geometry_budget_mb") != config.end()) {
+        params.geometry_budget = config["geometry_budget_mb"].get<size_t>() * 1024 * 1024;
+    }
+    if (config.find("lod_levels") != config.end()) {
+        params.lod_levels = config["lod_levels"].get<uint32_t>();
+    }
+    if (config.find("lod_threshold") != config.end()) {
+        params.lod_threshold = config["lod_threshold"].get<float>();
+    }
+    if (config.find("light_sampling") != config.end()) {
+        params.light_sampling =
+            parse_light_sampling(config["light_sampling"].get<std::string>());
+    }
+    if (config.find("ris_candidates") != config.end()) {
+        params.ris_candidates = config["ris_candidates"].get<uint32_t>();
+    }
+    if (config.find("ris_temporal_reuse") != config.end()) {
+        params.ris_temporal_reuse = config["ris_temporal_reuse"].get<bool>();
+    }
+    if (config.find("ris_spatial_reuse") != config.end()) {
+        params.ris_spatial_reuse = config["ris_spatial_reuse"].get<bool>();
+    }
+    if (config.find("sampler") != config.end()) {
+        params.sampler = parse_sampler(config["sampler"].get<std::string>());
+    }
+    if (config.find("denoise") != config.end()) {
+        params.denoise = config["denoise"].get<bool>();
+    }
+    if (config.find("aovs") != config.end()) {
+        params.aovs = config["aovs"].get<bool>();
+    }
+    if (config.find("radiance_cache") != config.end()) {
+        params.radiance_cache = config["radiance_cache"].get<bool>();
+    }
+    if (config.find("radiance_cache_bounce") != config.end()) {
+        params.radiance_cache_bounce = config["radiance_cache_bounce"].get<uint32_t>();
+    }
+    if (config.find("radiance_cache_resolution") != config.end()) {
+        params.radiance_cache_resolution =
+            config["radiance_cache_resolution"].get<uint32_t>();
+    }
+    if (config.find("path_guiding") != config.end()) {
+        params.path_guiding = config["path_guiding"].get<bool>();
+    }
+    if (config.find("max_path_depth") != config.end()) {
+        params.max_path_depth = config["max_path_depth"].get<uint32_t>();
+    }
+    if (config.find("max_diffuse_depth") != config.end()) {
+        params.max_diffuse_depth = config["max_diffuse_depth"].get<uint32_t>();
+    }
+    if (config.find("max_specular_depth") != config.end()) {
+        params.max_specular_depth = config["max_specular_depth"].get<uint32_t>();
+    }
+    if (config.find("roulette_start") != config.end()) {
+        params.roulette_start = config["roulette_start"].get<uint32_t>();
+    }
+    if (config.find("roulette") != config.end()) {
+        params.roulette = parse_roulette(config["roulette"].get<std::string>());
+    }
+    if (config.find("environment_map") != config.end()) {
+        params.environment_map = config["environment_map"].get<std::string>();
+    }
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Storage layout of the texels in each texture mip level
+enum class TextureLayout {
+    // Scanline order
+    LINEAR,
+    // 4x4 texel tiles stored contiguously, tiles are in scanline order
+    TILED,
+    // 4x4 texel blocks encoded in BCn style block compressed formats
+    COMPRESSED
+};
+
+// Quality of the acceleration structures, trading build time for render performance
+enum class BVHQuality {
+    // Fast builds for previews
+    LOW,
+    MEDIUM,
+    // Slower builds with spatial splits for final renders
+    HIGH
+};
+
+// How lights are picked for next event estimation
+enum class LightSampling {
+    // Proportionally to their power
+    POWER,
+    // By traversing a light BVH, accounting for the lights' distance and orientation
+    BVH
+};
+
+// How the sample values for each pixel sample are generated
+enum class SamplerType {
+    // Independent random numbers from a per-pixel LCG
+    LCG,
+    // Owen scrambled Sobol points
+    SOBOL,
+    // A low discrepancy sequence over the samples, dithered across pixels by blue noise
+    BLUE_NOISE
+};
+
+// How Russian roulette picks the probability of terminating paths
+enum class RouletteMode {
+    // From the path's throughput
+    THROUGHPUT,
+    // From the path's expected contribution relative to its pixel's estimate
+    EFFICIENCY
+};
+
+/* Renderer options specified on the command line. Backends which don't
+ * support some option will just ignore it
+ */
+struct RenderParams {
+    TextureLayout texture_layout = TextureLayout::LINEAR;
+    /* Memory budget in bytes for the texture cache, 0 keeps all textures resident. With
+     * the cache the scene's textures are left encoded and decoded on demand by the cache
+     */
+    size_t texture_cache_budget = 0;
+    /* Tile file the texture cache pages textures in from. It's kept between runs along
+     * with an index file next to it, so later runs reuse the tiles without decoding
+     */
+    std::string texture_cache_file = "texture_cache.bin";
+
+    BVHQuality bvh_quality = BVHQuality::MEDIUM;
+    // Use a more compact BVH layout, trading some render performance for memory
+    bool bvh_compact = false;
+    // Use more robust ray traversal, avoiding missed hits along edges at some cost
+    bool bvh_robust = false;
+
+    /* Store quantized uvs in buffers owned by the backend. The backend copies the
+     * vertices and indices so it doesn't reference the scene's meshes, which reduces
+     * memory use only once the application releases its scene
+     */
+    bool compact_attributes = false;
+    // Store an interleaved record of the attributes needed to shade each triangle
+    bool shading_records = false;
+
+    /* Memory budget in bytes for the mesh data of out-of-core scenes, 0 loads the whole
+     * scene. Out-of-core scenes leave the mesh data in the memory mapped scene file and
+     * the backend loads meshes on demand, evicting them to stay under the budget
+     */
+    size_t geometry_budget = 0;
+
+    /* Number of simplified levels of detail for each mesh, 0 disables LOD. Instances use
+     * the coarsest level whose triangle edges project to at most lod_threshold pixels,
+     * levels are only generated once an instance first selects them
+     */
+    uint32_t lod_levels = 0;
+    float lod_threshold = 1.f;
+
+    LightSampling light_sampling = LightSampling::BVH;
+
+    /* Number of light candidates to resample for the direct lighting at primary hits, 0
+     * uses regular light and BSDF sampling. The resampled reservoirs can be reused from
+     * the pixel's previous frame and from nearby pixels
+     */
+    uint32_t ris_candidates = 0;
+    bool ris_temporal_reuse = false;
+    bool ris_spatial_reuse = false;
+
+    SamplerType sampler = SamplerType::LCG;
+
+    /* Denoise the displayed image, filtering the accumulated image guided by the albedo,
+     * shading normal and depth at each pixel's first non-specular hit
+     */
+    bool denoise = false;
+
+    /* Render the arbitrary output variables (AOVs) for compositing: direct and indirect
+     * lighting, albedo, shading normal, depth, instance and material IDs and the
+     * per-pixel sample count. Saved images are also written as a multi-layer EXR with
+     * the AOVs
+     */
+    bool aovs = false;
+
+    /* Terminate paths into a world space radiance cache after radiance_cache_bounce (1
+     * or 2) diffuse bounces. The cache is a hash grid with radiance_cache_resolution
+     * cells along the scene's bounding box diagonal, trained each frame from full length
+     * paths traced for a subset of the pixels
+     */
+    bool radiance_cache = false;
+    uint32_t radiance_cache_bounce = 1;
+    uint32_t radiance_cache_resolution = 512;
+
+    /* Guide the directions paths continue in by a distribution of the incident radiance
+     * learned online from the rendered paths, combined with BSDF sampling by MIS
+     */
+    bool path_guiding = false;
+
+    /* Maximum number of bounces of each path, and of its bounces off diffuse and off
+     * specular materials, where 0 is no per-material limit. Specular materials are any
+     * transmissive (glass) or metallic (metallic > 0.5) material, smooth or rough.
+     * Russian roulette starts after roulette_start bounces. Efficiency aware roulette
+     * estimates the path's contribution from the radiance cache when it's enabled
+     */
+    uint32_t max_path_depth = 5;
+    uint32_t max_diffuse_depth = 0;
+    uint32_t max_specular_depth = 0;
+    uint32_t roulette_start = 3;
+    RouletteMode roulette = RouletteMode::THROUGHPUT;
+
+    // Equirectangular HDR environment map (.hdr) to light the scene with, if any
+    std::string environment_map;
+};
+
+// Parse the layout name (linear, tiled or compressed), throws if it's not valid
+TextureLayout parse_texture_layout(const std::string &name);
+
+// Parse the BVH quality name (low, medium or high), throws if it's not valid
+BVHQuality parse_bvh_quality(const std::string &name);
+
+// Parse the light sampling name (power or bvh), throws if it's not valid
+LightSampling parse_light_sampling(const std::string &name);
+
+// Parse the sampler name (lcg, sobol or blue-noise), throws if it's not valid
+SamplerType parse_sampler(const std::string &name);
+
+// Parse the roulette mode name (throughput or efficiency), throws if it's not valid
+RouletteMode parse_roulette(const std::string &name);
+
+/* Load render params from a JSON config file, overriding the current values of any
+ * params specified in it. The config is an object with the keys:
+ * "texture_layout": string, "texture_cache_mb": number, "texture_cache_file": string,
+ * "bvh_quality": string, "bvh_compact": bool, "bvh_robust": bool,
+ * "compact_attributes": bool, "shading_records": bool, "geometry_budget_mb": number,
+ * "lod_levels": number, "lod_threshold": number, "light_sampling": string,
+ * "ris_candidates": number, "ris_temporal_reuse": bool, "ris_spatial_reuse": bool,
+ * "sampler": string, "denoise": bool, "aovs": bool, "radiance_cache": bool,
+ * "radiance_cache_bounce": number, "radiance_cache_resolution": number,
+ * "path_guiding": bool, "max_path_depth": number,
+ * "max_diffuse_depth": number, "max_specular_depth": number, "roulette_start": number,
+ * "roulette": string, "environment_map": string
+ */
+void load_render_config(const std::string &file, RenderParams &params);
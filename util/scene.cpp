@@ -1,9 +1,12 @@
 #include "scene.h"
 #include <algorithm>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <numeric>
 #include <stdexcept>
 #include <vector>
+#include <sys/stat.h>
 #include "buffer_view.h"
 #include "file_mapping.h"
 #include "flatten_gltf.h"
@@ -46,8 +49,88 @@ bool operator==(const glm::uvec3 &a, const glm::uvec3 &b)
     return a.x == b.x && a.y == b.y && a.z == b.z;
 }
 
-Scene::Scene(const std::string &fname, MaterialMode material_mode)
-    : material_mode(material_mode)
+template <typename T>
+static size_t hash_buffer(const std::vector<T> &buf, const size_t h)
+{
+    return hash_bytes(buf.data(), buf.size() * sizeof(T), h);
+}
+
+/* Hash the geometry's content. The vertex positions are hashed relative to the first
+ * vertex so that translated copies of the geometry hash to the same value, and are
+ * quantized far more coarsely than the rounding error find_geometry_offset allows for.
+ * Copies rounding to different cells are just not deduplicated, find_geometry_offset
+ * makes the final comparison
+ */
+static size_t hash_geometry(const Geometry &geom)
+{
+    size_t h = phmap::HashState().combine(
+        0, geom.vertices.size(), geom.normals.size(), geom.uvs.size(), geom.indices.size());
+    h = hash_buffer(geom.indices, h);
+    h = hash_buffer(geom.normals, h);
+    h = hash_buffer(geom.uvs, h);
+    if (geom.vertices.empty()) {
+        return h;
+    }
+
+    const glm::vec3 origin = geom.vertices[0];
+    glm::vec3 extent(0.f);
+    for (const auto &v : geom.vertices) {
+        extent = glm::max(extent, glm::abs(v - origin));
+    }
+    const float max_extent = glm::max(extent.x, glm::max(extent.y, extent.z));
+    const float quantum = max_extent > 0.f ? max_extent / 4096.f : 1.f;
+    for (const auto &v : geom.vertices) {
+        const glm::ivec3 q = glm::ivec3(glm::round((v - origin) / quantum));
+        h = hash_bytes(&q, sizeof(q), h);
+    }
+    return h;
+}
+
+/* Check if b is a copy of a translated by some offset, returning the offset. The vertex
+ * positions are compared with a small tolerance to allow for the rounding error
+ * introduced by the translation
+ */
+static bool find_geometry_offset(const Geometry &a, const Geometry &b, glm::vec3 &offset)
+{
+    if (a.vertices.size() != b.vertices.size() || a.indices != b.indices ||
+        a.normals != b.normals || a.uvs != b.uvs) {
+        return false;
+    }
+    offset = a.vertices.empty() ? glm::vec3(0.f) : b.vertices[0] - a.vertices[0];
+    const float offset_len = glm::length(offset);
+    for (size_t i = 0; i < a.vertices.size(); ++i) {
+        const float eps = 1e-5f * (1.f + glm::length(a.vertices[i]) + offset_len);
+        if (glm::length(b.vertices[i] - a.vertices[i] - offset) > eps) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Check if b is a copy of a translated by some offset, returning the offset
+static bool find_mesh_offset(const Mesh &a, const Mesh &b, glm::vec3 &offset)
+{
+    if (a.geometries.size() != b.geometries.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.geometries.size(); ++i) {
+        glm::vec3 geom_offset;
+        if (!find_geometry_offset(a.geometries[i], b.geometries[i], geom_offset)) {
+            return false;
+        }
+        if (i == 0) {
+            offset = geom_offset;
+        } else if (glm::length(geom_offset - offset) > 1e-5f * (1.f + glm::length(offset))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Scene::Scene(const std::string &fname,
+             MaterialMode material_mode,
+             const RenderParams &render_params)
+    : render_params(render_params), material_mode(material_mode)
 {
     const std::string ext = get_file_extension(fname);
     if (ext == "obj") {
@@ -64,10 +147,34 @@ Scene::Scene(const std::string &fname, MaterialMode material_mode)
         std::cout << "Unsupported file '" << fname << "'\n";
         throw std::runtime_error("Unsupported file " + fname);
     }
+
+    if (render_params.geometry_budget > 0 && !out_of_core()) {
+        std::cout << "Warning: Out-of-core rendering is only supported for CRTS scenes, "
+                     "loaded the whole scene\n";
+    }
+
+    if (!render_params.environment_map.empty()) {
+        environment = HDRImage(render_params.environment_map);
+    }
+
+    deduplicate_textures();
+    // Finding duplicate meshes would require reading all the mesh data of out-of-core
+    // scenes, so they're only deduplicated when loaded into memory
+    if (!out_of_core()) {
+        deduplicate_meshes();
+    }
 }
 
 size_t Scene::unique_tris() const
 {
+    if (out_of_core()) {
+        return std::accumulate(streamed_meshes.begin(),
+                               streamed_meshes.end(),
+                               size_t(0),
+                               [](const size_t &n, const StreamedMesh &m) {
+                                   return n + m.num_tris;
+                               });
+    }
     return std::accumulate(
         meshes.begin(), meshes.end(), 0, [](const size_t &n, const Mesh &m) {
             return n + m.num_tris();
@@ -76,19 +183,193 @@ size_t Scene::unique_tris() const
 
 size_t Scene::total_tris() const
 {
-    return std::accumulate(
-        instances.begin(), instances.end(), 0, [&](const size_t &n, const Instance &i) {
-            return n +
-                   meshes[parameterized_meshes[i.parameterized_mesh_id].mesh_id].num_tris();
-        });
+    auto count_tris = [&](const size_t &n, const Instance &i) {
+        const size_t mesh_id = parameterized_meshes[i.parameterized_mesh_id].mesh_id;
+        if (out_of_core()) {
+            return n + streamed_meshes[mesh_id].num_tris;
+        }
+        return n + meshes[mesh_id].num_tris();
+    };
+    size_t total = std::accumulate(instances.begin(), instances.end(), size_t(0), count_tris);
+    for (const auto &gi : group_instances) {
+        const auto &group = instance_groups[gi.group_id];
+        total = std::accumulate(
+            group.instances.begin(), group.instances.end(), total, count_tris);
+    }
+    return total;
 }
 
 size_t Scene::num_geometries() const
 {
-    return std::accumulate(
-        meshes.begin(), meshes.end(), 0, [](const size_t &n, const Mesh &m) {
-            return n + m.geometries.size();
-        });
+    // Streamed meshes have a single geometry
+    return std::accumulate(meshes.begin(),
+                           meshes.end(),
+                           streamed_meshes.size(),
+                           [](const size_t &n, const Mesh &m) {
+                               return n + m.geometries.size();
+                           });
+}
+
+void Scene::memory_report(MemoryReport &report) const
+{
+    size_t vertex_bytes = 0;
+    size_t index_bytes = 0;
+    size_t normal_bytes = 0;
+    size_t uv_bytes = 0;
+    for (const auto &m : meshes) {
+        for (const auto &g : m.geometries) {
+            vertex_bytes += g.vertices.capacity() * sizeof(glm::vec3);
+            index_bytes += g.indices.capacity() * sizeof(glm::uvec3);
+            normal_bytes += g.normals.capacity() * sizeof(glm::vec3);
+            uv_bytes += g.uvs.capacity() * sizeof(glm::vec2);
+        }
+    }
+    size_t texture_bytes = 0;
+    for (const auto &t : textures) {
+        texture_bytes += t.img.capacity() + t.encoded.capacity();
+    }
+
+    report.add("scene/vertices", vertex_bytes);
+    report.add("scene/indices", index_bytes);
+    report.add("scene/normals", normal_bytes);
+    report.add("scene/uvs", uv_bytes);
+    report.add("scene/textures", texture_bytes);
+    if (!environment.img.empty()) {
+        report.add("scene/environment", environment.img.capacity() * sizeof(float));
+    }
+}
+
+bool Scene::out_of_core() const
+{
+    return !streamed_meshes.empty();
+}
+
+void Scene::flatten_instance_groups()
+{
+    if (group_instances.empty()) {
+        return;
+    }
+    for (const auto &gi : group_instances) {
+        for (const auto &i : instance_groups[gi.group_id].instances) {
+            instances.emplace_back(gi.transform * i.transform, i.parameterized_mesh_id);
+        }
+    }
+    std::cout << "Flattened " << group_instances.size() << " group instances to "
+              << instances.size() << " instances\n";
+    group_instances.clear();
+    instance_groups.clear();
+}
+
+void Scene::release_shading_data()
+{
+    materials = std::vector<DisneyMaterial>();
+    textures = std::vector<Image>();
+    environment = HDRImage();
+    lights = std::vector<QuadLight>();
+}
+
+Scene Scene::parameters() const
+{
+    Scene params;
+    params.cameras = cameras;
+    params.camParams = camParams;
+    params.render_params = render_params;
+    params.samples_per_pixel = samples_per_pixel;
+    params.material_mode = material_mode;
+    return params;
+}
+
+Image Scene::load_texture(const std::string &file,
+                          const std::string &name,
+                          ColorSpace color_space) const
+{
+    if (render_params.texture_cache_budget > 0) {
+        return Image::encoded_file(file, name, color_space);
+    }
+    return Image(file, name, color_space);
+}
+
+// Keep the glTF images encoded for the texture cache, just reading their size
+static bool load_encoded_gltf_image(tinygltf::Image *image,
+                                    const int,
+                                    std::string *err,
+                                    std::string *,
+                                    int,
+                                    int,
+                                    const unsigned char *bytes,
+                                    int size,
+                                    void *)
+{
+    int x, y, n;
+    if (!stbi_info_from_memory(bytes, size, &x, &y, &n)) {
+        if (err) {
+            *err += "Failed to read the header of image '" + image->name + "'\n";
+        }
+        return false;
+    }
+    image->width = x;
+    image->height = y;
+    image->component = 4;
+    image->bits = 8;
+    image->pixel_type = TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE;
+    image->image.assign(bytes, bytes + size);
+    return true;
+}
+
+void Scene::load_streamed_mesh_bounds(const std::string &file,
+                                      const std::vector<size_t> &mesh_ids)
+{
+    // The cache is only valid for the same version of the scene file
+    struct stat st = {};
+    stat(file.c_str(), &st);
+    const uint64_t file_size = st.st_size;
+    const int64_t file_time = st.st_mtime;
+    const uint64_t num_meshes = mesh_ids.size();
+    const std::string cache_file = file + ".bounds";
+
+    std::ifstream in(cache_file, std::ios::binary);
+    if (in) {
+        uint64_t cached_size = 0;
+        int64_t cached_time = 0;
+        uint64_t cached_meshes = 0;
+        in.read(reinterpret_cast<char *>(&cached_size), sizeof(cached_size));
+        in.read(reinterpret_cast<char *>(&cached_time), sizeof(cached_time));
+        in.read(reinterpret_cast<char *>(&cached_meshes), sizeof(cached_meshes));
+        if (in && cached_size == file_size && cached_time == file_time &&
+            cached_meshes == num_meshes) {
+            for (const auto &id : mesh_ids) {
+                StreamedMesh &mesh = streamed_meshes[id];
+                in.read(reinterpret_cast<char *>(&mesh.bounds_min), sizeof(glm::vec3));
+                in.read(reinterpret_cast<char *>(&mesh.bounds_max), sizeof(glm::vec3));
+            }
+            if (in) {
+                return;
+            }
+        }
+    }
+
+    std::cout << "Computing the bounds of " << num_meshes
+              << " streamed meshes, caching them in " << cache_file << "\n";
+    std::ofstream out(cache_file, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(&file_size), sizeof(file_size));
+    out.write(reinterpret_cast<const char *>(&file_time), sizeof(file_time));
+    out.write(reinterpret_cast<const char *>(&num_meshes), sizeof(num_meshes));
+    for (const auto &id : mesh_ids) {
+        StreamedMesh &mesh = streamed_meshes[id];
+        if (mesh.num_vertices > 0) {
+            mesh.bounds_min = mesh.vertices[0];
+            mesh.bounds_max = mesh.vertices[0];
+        }
+        for (size_t i = 0; i < mesh.num_vertices; ++i) {
+            mesh.bounds_min = glm::min(mesh.bounds_min, mesh.vertices[i]);
+            mesh.bounds_max = glm::max(mesh.bounds_max, mesh.vertices[i]);
+        }
+        out.write(reinterpret_cast<const char *>(&mesh.bounds_min), sizeof(glm::vec3));
+        out.write(reinterpret_cast<const char *>(&mesh.bounds_max), sizeof(glm::vec3));
+    }
+    if (!out) {
+        std::cout << "Warning: Failed to write the bounds cache " << cache_file << "\n";
+    }
 }
 
 void Scene::load_obj(const std::string &file)
@@ -111,7 +392,7 @@ void Scene::load_obj(const std::string &file)
         throw std::runtime_error("TinyOBJ Error loading " + file + " error: " + err);
     }
 
-    Mesh mesh;
+    std::vector<Geometry> geometries;
     std::vector<uint32_t> material_ids;
     for (size_t s = 0; s < shapes.size(); ++s) {
         // We load with triangulate on so we know the mesh will be all triangle faces
@@ -177,13 +458,70 @@ void Scene::load_obj(const std::string &file)
             }
             geom.indices.push_back(tri_indices);
         }
-        mesh.geometries.push_back(geom);
+        geometries.push_back(geom);
     }
-    meshes.push_back(mesh);
 
-    // OBJ has a single "parameterized mesh" and "instance"
-    parameterized_meshes.emplace_back(0, material_ids);
-    instances.emplace_back(glm::mat4(1.f), 0);
+    // OBJ has no instancing, but exports often contain many (translated) copies of the
+    // same object as separate groups. Find these so we can instance them
+    std::vector<size_t> canonical_geom(geometries.size());
+    std::vector<glm::vec3> geom_offsets(geometries.size(), glm::vec3(0.f));
+    std::vector<size_t> num_copies(geometries.size(), 0);
+    phmap::flat_hash_map<size_t, std::vector<size_t>> geometry_hashes;
+    for (size_t i = 0; i < geometries.size(); ++i) {
+        canonical_geom[i] = i;
+        auto &candidates = geometry_hashes[hash_geometry(geometries[i])];
+        for (const auto &c : candidates) {
+            if (find_geometry_offset(geometries[c], geometries[i], geom_offsets[i])) {
+                canonical_geom[i] = c;
+                ++num_copies[c];
+                break;
+            }
+        }
+        if (canonical_geom[i] == i) {
+            candidates.push_back(i);
+        }
+    }
+
+    // The geometries which appear once are put in a single "parameterized mesh" and
+    // "instance"
+    Mesh mesh;
+    std::vector<uint32_t> mesh_material_ids;
+    for (size_t i = 0; i < geometries.size(); ++i) {
+        if (canonical_geom[i] == i && num_copies[i] == 0) {
+            mesh.geometries.push_back(std::move(geometries[i]));
+            mesh_material_ids.push_back(material_ids[i]);
+        }
+    }
+    if (!mesh.geometries.empty()) {
+        parameterized_meshes.emplace_back(meshes.size(), mesh_material_ids);
+        instances.emplace_back(glm::mat4(1.f), parameterized_meshes.size() - 1);
+        meshes.push_back(std::move(mesh));
+    }
+
+    // Each repeated geometry becomes its own mesh, with a parameterized mesh for each
+    // material it's used with and an instance for each copy
+    phmap::flat_hash_map<size_t, size_t> geom_mesh_ids;
+    phmap::flat_hash_map<glm::uvec2, size_t> geom_param_mesh_ids;
+    for (size_t i = 0; i < geometries.size(); ++i) {
+        const size_t c = canonical_geom[i];
+        if (num_copies[c] == 0) {
+            continue;
+        }
+        if (c == i) {
+            geom_mesh_ids[c] = meshes.size();
+            meshes.emplace_back(std::vector<Geometry>{std::move(geometries[c])});
+        }
+        const glm::uvec2 param_mesh_key(geom_mesh_ids[c], material_ids[i]);
+        auto fnd = geom_param_mesh_ids.find(param_mesh_key);
+        if (fnd == geom_param_mesh_ids.end()) {
+            fnd = geom_param_mesh_ids
+                      .emplace(param_mesh_key, parameterized_meshes.size())
+                      .first;
+            parameterized_meshes.emplace_back(param_mesh_key.x,
+                                              std::vector<uint32_t>{material_ids[i]});
+        }
+        instances.emplace_back(glm::translate(glm::mat4(1.f), geom_offsets[i]), fnd->second);
+    }
 
     if (material_mode == MaterialMode::DEFAULT) {
         phmap::parallel_flat_hash_map<std::string, int32_t> texture_ids;
@@ -202,7 +540,8 @@ void Scene::load_obj(const std::string &file)
                 canonicalize_path(path);
                 if (texture_ids.find(m.diffuse_texname) == texture_ids.end()) {
                     texture_ids[m.diffuse_texname] = textures.size();
-                    textures.emplace_back(obj_base_dir + "/" + path, m.diffuse_texname, SRGB);
+                    textures.push_back(
+                        load_texture(obj_base_dir + "/" + path, m.diffuse_texname, SRGB));
                 }
                 const int32_t id = texture_ids[m.diffuse_texname];
                 uint32_t tex_mask = TEXTURED_PARAM_MASK;
@@ -233,6 +572,9 @@ void Scene::load_gltf(const std::string &fname)
 
     tinygltf::Model model;
     tinygltf::TinyGLTF context;
+    if (render_params.texture_cache_budget > 0) {
+        context.SetImageLoader(load_encoded_gltf_image, nullptr);
+    }
     std::string err, warn;
     bool ret = false;
     if (get_file_extension(fname) == "gltf") {
@@ -337,13 +679,17 @@ void Scene::load_gltf(const std::string &fname)
                 throw std::runtime_error("Unsupported image pixel type");
             }
 
+            // Assume linear unless we find it used as a color texture
+            if (render_params.texture_cache_budget > 0) {
+                textures.push_back(Image::encoded_buffer(img.image, img.name, LINEAR, false));
+                continue;
+            }
             Image texture;
             texture.name = img.name;
             texture.width = img.width;
             texture.height = img.height;
             texture.channels = img.component;
             texture.img = img.image;
-            // Assume linear unless we find it used as a color texture
             texture.color_space = LINEAR;
             textures.push_back(texture);
         }
@@ -426,11 +772,55 @@ void Scene::load_crts(const std::string &file)
         json::parse(mapping->data() + sizeof(uint64_t), mapping->data() + total_header_size);
 
     const uint8_t *data_base = mapping->data() + total_header_size;
+    auto get_view = [&](const uint64_t view_id) {
+        auto &v = header["buffer_views"][view_id];
+        const DTYPE dtype = parse_dtype(v["type"]);
+        return BufferView(data_base + v["byte_offset"].get<uint64_t>(),
+                          v["byte_length"].get<uint64_t>(),
+                          dtype_stride(dtype));
+    };
+
+    /* For out-of-core rendering the mesh data is left in the file, we just need the
+     * bounds of each mesh to place it in the scene. These are read from the mesh's
+     * "bounds" in the header, older files without them have the bounds of their meshes
+     * computed once and kept in a bounds cache file next to the scene
+     */
+    std::vector<size_t> missing_bounds;
+    if (render_params.geometry_budget > 0) {
+        std::cout << "Streaming meshes out-of-core from " << file << "\n";
+        this->mapping = mapping;
+        streamed_meshes.resize(header["meshes"].size());
+        meshes.resize(header["meshes"].size());
+    }
     // Blender only supports a single geometry per-mesh so this works kind of like a blend of
     // GLTF and OBJ
     for (size_t i = 0; i < header["meshes"].size(); ++i) {
         auto &m = header["meshes"][i];
 
+        if (out_of_core()) {
+            StreamedMesh &mesh = streamed_meshes[i];
+            Accessor<glm::vec3> vertices(get_view(m["positions"].get<uint64_t>()));
+            mesh.vertices = vertices.begin();
+            mesh.num_vertices = vertices.size();
+            Accessor<glm::uvec3> indices(get_view(m["indices"].get<uint64_t>()));
+            mesh.indices = indices.begin();
+            mesh.num_tris = indices.size();
+            if (m.find("texcoords") != m.end()) {
+                Accessor<glm::vec2> uvs(get_view(m["texcoords"].get<uint64_t>()));
+                mesh.uvs = uvs.begin();
+                mesh.num_uvs = uvs.size();
+            }
+            if (m.find("bounds") != m.end()) {
+                for (int j = 0; j < 3; ++j) {
+                    mesh.bounds_min[j] = m["bounds"]["min"][j].get<float>();
+                    mesh.bounds_max[j] = m["bounds"]["max"][j].get<float>();
+                }
+            } else {
+                missing_bounds.push_back(i);
+            }
+            continue;
+        }
+
         Geometry geom;
         {
             const uint64_t view_id = m["positions"].get<uint64_t>();
@@ -440,7 +830,10 @@ void Scene::load_crts(const std::string &file)
                             v["byte_length"].get<uint64_t>(),
                             dtype_stride(dtype));
             Accessor<glm::vec3> accessor(view);
-            geom.vertices = std::vector<glm::vec3>(accessor.begin(), accessor.end());
+            // Reserve an extra vertex so renderers which need the vertex buffer padded
+            // can share it instead of making a padded copy
+            geom.vertices.reserve(accessor.size() + 1);
+            geom.vertices.assign(accessor.begin(), accessor.end());
         }
         {
             const uint64_t view_id = m["indices"].get<uint64_t>();
@@ -476,8 +869,12 @@ void Scene::load_crts(const std::string &file)
 #endif
 
         Mesh mesh;
-        mesh.geometries.push_back(geom);
-        meshes.push_back(mesh);
+        mesh.geometries.push_back(std::move(geom));
+        meshes.push_back(std::move(mesh));
+    }
+
+    if (!missing_bounds.empty()) {
+        load_streamed_mesh_bounds(file, missing_bounds);
     }
 
     for (size_t i = 0; i < header["images"].size(); ++i) {
@@ -491,6 +888,21 @@ void Scene::load_crts(const std::string &file)
                         dtype_stride(dtype));
         Accessor<uint8_t> accessor(view);
 
+        ColorSpace color_space = SRGB;
+        if (img["color_space"].get<std::string>() == "LINEAR") {
+            color_space = LINEAR;
+        }
+
+        // Images paged in by the texture cache are decoded from the scene file on demand
+        if (render_params.texture_cache_budget > 0) {
+            textures.push_back(Image::encoded_file(file,
+                                                   img["name"].get<std::string>(),
+                                                   color_space,
+                                                   accessor.begin() - mapping->data(),
+                                                   accessor.size()));
+            continue;
+        }
+
         stbi_set_flip_vertically_on_load(1);
         int x, y, n;
         uint8_t *img_data =
@@ -501,11 +913,6 @@ void Scene::load_crts(const std::string &file)
             throw std::runtime_error("Failed to load " + img["name"].get<std::string>());
         }
 
-        ColorSpace color_space = SRGB;
-        if (img["color_space"].get<std::string>() == "LINEAR") {
-            color_space = LINEAR;
-        }
-
         textures.emplace_back(img_data, x, y, 4, img["name"].get<std::string>(), color_space);
         stbi_image_free(img_data);
     }
@@ -639,7 +1046,6 @@ void Scene::load_pbrt(const std::string &file)
             throw std::runtime_error("Failed to load PBRT scene from " + file);
         }
 
-        scene->makeSingleLevel();
     } catch (const std::runtime_error &e) {
         std::cout << "Error loading PBRT scene " << file << "\n";
         throw e;
@@ -647,137 +1053,146 @@ void Scene::load_pbrt(const std::string &file)
 
     const std::string pbrt_base_dir = file.substr(0, file.rfind('/'));
 
-    // TODO: The world can also have some top-level things we may need to load. But is this
-    // common? Or does Ingo's make single level flatten these down to a shape?
-    for (const auto &obj : scene->world->shapes) {
-        if (obj->material) {
-            std::cout << "Top level Mat: " << obj->material->toString() << "\n";
-        }
-
-        // What would these top-level textures be used for?
-        if (!obj->textures.empty()) {
-            std::cout << "top level textures " << obj->textures.size() << "\n";
-            for (const auto &t : obj->textures) {
-                auto img_tex = std::dynamic_pointer_cast<pbrt::ImageTexture>(t.second);
-                if (img_tex) {
-                    std::cout << "Image texture: " << t.first << " from file "
-                              << img_tex->fileName << "\n";
-                } else {
-                    std::cout << "Unsupported non-image texture used by texture '" << t.first
-                              << "'\n";
-                }
-            }
-        }
-
-        if (obj->areaLight) {
-            std::cout << "Encountered area light\n";
-        }
-
-        if (pbrt::TriangleMesh::SP mesh = std::dynamic_pointer_cast<pbrt::TriangleMesh>(obj)) {
-            std::cout << "Found root level triangle mesh w/ " << mesh->index.size()
-                      << " triangles: " << mesh->toString() << "\n";
-        } else if (pbrt::QuadMesh::SP mesh = std::dynamic_pointer_cast<pbrt::QuadMesh>(obj)) {
-            std::cout << "Encountered root level quadmesh (unsupported type). Will TODO maybe "
-                         "triangulate\n";
-        } else {
-            std::cout << "un-handled root level geometry type : " << obj->toString()
-                      << std::endl;
-        }
-    }
-
     // For PBRTv3 Each Mesh corresponds to a PBRT Object, consisting of potentially
     // multiple Shapes. This maps to a Mesh with multiple geometries, which can then be
-    // instanced
+    // instanced. PBRT geometries are also parameterized with a material, similar to GLTF.
+    // Returns the parameterized mesh for the object's shapes, or -1 if it has none
     phmap::parallel_flat_hash_map<pbrt::Material::SP, size_t> pbrt_materials;
     phmap::parallel_flat_hash_map<pbrt::Texture::SP, size_t> pbrt_textures;
-    phmap::parallel_flat_hash_map<std::string, size_t> pbrt_objects;
-    for (const auto &inst : scene->world->instances) {
-        // Check if this object has already been loaded for the instance
-        // PBRT geometries are also parameterized with a material, similar to GLTF
-        auto fnd = pbrt_objects.find(inst->object->name);
-        size_t parameterized_mesh_id = -1;
-        if (fnd == pbrt_objects.end()) {
-            std::cout << "Loading newly encountered instanced object " << inst->object->name
+    phmap::parallel_flat_hash_map<pbrt::Object::SP, size_t> pbrt_objects;
+    auto load_object = [&](const pbrt::Object::SP &object) {
+        // Check if this object has already been loaded for another instance
+        auto fnd = pbrt_objects.find(object);
+        if (fnd != pbrt_objects.end()) {
+            return fnd->second;
+        }
+        if (!object->shapes.empty()) {
+            std::cout << "Loading newly encountered instanced object " << object->name
                       << "\n";
+        }
 
-            std::vector<uint32_t> material_ids;
-            std::vector<Geometry> geometries;
-            for (const auto &g : inst->object->shapes) {
-                if (pbrt::TriangleMesh::SP mesh =
-                        std::dynamic_pointer_cast<pbrt::TriangleMesh>(g)) {
-                    std::cout << "Object triangle mesh w/ " << mesh->index.size()
-                              << " triangles: " << mesh->toString() << "\n";
-
-                    uint32_t material_id = -1;
-                    if (material_mode == MaterialMode::DEFAULT && mesh->material) {
-                        material_id = load_pbrt_materials(mesh->material,
-                                                          mesh->textures,
-                                                          pbrt_base_dir,
-                                                          pbrt_materials,
-                                                          pbrt_textures);
-                    }
-                    material_ids.push_back(material_id);
-
-                    Geometry geom;
-                    geom.vertices.reserve(mesh->vertex.size());
-                    std::transform(
-                        mesh->vertex.begin(),
-                        mesh->vertex.end(),
-                        std::back_inserter(geom.vertices),
-                        [](const pbrt::vec3f &v) { return glm::vec3(v.x, v.y, v.z); });
-
-                    geom.indices.reserve(mesh->index.size());
-                    std::transform(
-                        mesh->index.begin(),
-                        mesh->index.end(),
-                        std::back_inserter(geom.indices),
-                        [](const pbrt::vec3i &v) { return glm::ivec3(v.x, v.y, v.z); });
-
-                    geom.uvs.reserve(mesh->texcoord.size());
-                    std::transform(mesh->texcoord.begin(),
-                                   mesh->texcoord.end(),
-                                   std::back_inserter(geom.uvs),
-                                   [](const pbrt::vec2f &v) { return glm::vec2(v.x, v.y); });
-
-                    geometries.push_back(geom);
-                } else if (pbrt::QuadMesh::SP mesh =
-                               std::dynamic_pointer_cast<pbrt::QuadMesh>(g)) {
-                    std::cout << "Encountered instanced quadmesh (unsupported type). Will "
-                                 "TODO maybe triangulate\n";
-                } else {
-                    std::cout << "un-handled instanced geometry type : " << g->toString()
-                              << std::endl;
+        std::vector<uint32_t> material_ids;
+        std::vector<Geometry> geometries;
+        for (const auto &g : object->shapes) {
+            if (pbrt::TriangleMesh::SP mesh =
+                    std::dynamic_pointer_cast<pbrt::TriangleMesh>(g)) {
+                std::cout << "Object triangle mesh w/ " << mesh->index.size()
+                          << " triangles: " << mesh->toString() << "\n";
+
+                uint32_t material_id = -1;
+                if (material_mode == MaterialMode::DEFAULT && mesh->material) {
+                    material_id = load_pbrt_materials(mesh->material,
+                                                      mesh->textures,
+                                                      pbrt_base_dir,
+                                                      pbrt_materials,
+                                                      pbrt_textures);
                 }
+                material_ids.push_back(material_id);
+
+                Geometry geom;
+                geom.vertices.reserve(mesh->vertex.size());
+                std::transform(mesh->vertex.begin(),
+                               mesh->vertex.end(),
+                               std::back_inserter(geom.vertices),
+                               [](const pbrt::vec3f &v) { return glm::vec3(v.x, v.y, v.z); });
+
+                geom.indices.reserve(mesh->index.size());
+                std::transform(mesh->index.begin(),
+                               mesh->index.end(),
+                               std::back_inserter(geom.indices),
+                               [](const pbrt::vec3i &v) { return glm::ivec3(v.x, v.y, v.z); });
+
+                geom.uvs.reserve(mesh->texcoord.size());
+                std::transform(mesh->texcoord.begin(),
+                               mesh->texcoord.end(),
+                               std::back_inserter(geom.uvs),
+                               [](const pbrt::vec2f &v) { return glm::vec2(v.x, v.y); });
+
+                geometries.push_back(geom);
+            } else if (pbrt::QuadMesh::SP mesh =
+                           std::dynamic_pointer_cast<pbrt::QuadMesh>(g)) {
+                std::cout << "Encountered instanced quadmesh (unsupported type). Will "
+                             "TODO maybe triangulate\n";
+            } else {
+                std::cout << "un-handled instanced geometry type : " << g->toString()
+                          << std::endl;
             }
-            if (inst->object->instances.size() > 0) {
-                std::cout
-                    << "Warning: Potentially multilevel instancing is in the scene after "
-                       "flattening?\n";
-            }
-            // Mesh only contains unsupported objects, skip it
-            if (geometries.empty()) {
-                std::cout << "WARNING: Instance contains only unsupported geometries, "
-                             "skipping\n";
-                continue;
-            }
+        }
+
+        size_t parameterized_mesh_id = -1;
+        if (!geometries.empty()) {
             const size_t mesh_id = meshes.size();
             meshes.emplace_back(geometries);
 
             parameterized_mesh_id = parameterized_meshes.size();
             parameterized_meshes.emplace_back(mesh_id, material_ids);
-
-            pbrt_objects[inst->object->name] = parameterized_mesh_id;
-        } else {
-            parameterized_mesh_id = fnd->second;
+        } else if (!object->shapes.empty()) {
+            // Mesh only contains unsupported objects, skip it
+            std::cout << "WARNING: Instance contains only unsupported geometries, "
+                         "skipping\n";
         }
+        pbrt_objects[object] = parameterized_mesh_id;
+        return parameterized_mesh_id;
+    };
 
+    auto to_mat4 = [](const pbrt::affine3f &xfm) {
         glm::mat4 transform(1.f);
-        transform[0] = glm::vec4(inst->xfm.l.vx.x, inst->xfm.l.vx.y, inst->xfm.l.vx.z, 0.f);
-        transform[1] = glm::vec4(inst->xfm.l.vy.x, inst->xfm.l.vy.y, inst->xfm.l.vy.z, 0.f);
-        transform[2] = glm::vec4(inst->xfm.l.vz.x, inst->xfm.l.vz.y, inst->xfm.l.vz.z, 0.f);
-        transform[3] = glm::vec4(inst->xfm.p.x, inst->xfm.p.y, inst->xfm.p.z, 1.f);
+        transform[0] = glm::vec4(xfm.l.vx.x, xfm.l.vx.y, xfm.l.vx.z, 0.f);
+        transform[1] = glm::vec4(xfm.l.vy.x, xfm.l.vy.y, xfm.l.vy.z, 0.f);
+        transform[2] = glm::vec4(xfm.l.vz.x, xfm.l.vz.y, xfm.l.vz.z, 0.f);
+        transform[3] = glm::vec4(xfm.p.x, xfm.p.y, xfm.p.z, 1.f);
+        return transform;
+    };
+
+    // Add the object's shapes and the instances nested in it to the group, any deeper
+    // levels of instancing are flattened into the group
+    std::function<void(const pbrt::Object::SP &, const glm::mat4 &, InstanceGroup &)>
+        add_to_group = [&](const pbrt::Object::SP &object,
+                           const glm::mat4 &transform,
+                           InstanceGroup &group) {
+            const size_t parameterized_mesh_id = load_object(object);
+            if (parameterized_mesh_id != size_t(-1)) {
+                group.instances.emplace_back(transform, parameterized_mesh_id);
+            }
+            for (const auto &inst : object->instances) {
+                add_to_group(inst->object, transform * to_mat4(inst->xfm), group);
+            }
+        };
+
+    // Shapes in the world itself are placed with a single identity instance
+    const size_t world_mesh_id = load_object(scene->world);
+    if (world_mesh_id != size_t(-1)) {
+        instances.emplace_back(glm::mat4(1.f), world_mesh_id);
+    }
+
+    // Objects which just contain shapes are instanced directly, while objects which
+    // contain instances of other objects become instance groups
+    phmap::parallel_flat_hash_map<pbrt::Object::SP, size_t> pbrt_groups;
+    for (const auto &inst : scene->world->instances) {
+        const glm::mat4 transform = to_mat4(inst->xfm);
+        if (inst->object->instances.empty()) {
+            const size_t parameterized_mesh_id = load_object(inst->object);
+            if (parameterized_mesh_id != size_t(-1)) {
+                instances.emplace_back(transform, parameterized_mesh_id);
+            }
+            continue;
+        }
+
+        auto fnd = pbrt_groups.find(inst->object);
+        size_t group_id = -1;
+        if (fnd == pbrt_groups.end()) {
+            InstanceGroup group;
+            add_to_group(inst->object, glm::mat4(1.f), group);
+            group_id = instance_groups.size();
+            instance_groups.push_back(std::move(group));
+            pbrt_groups[inst->object] = group_id;
+        } else {
+            group_id = fnd->second;
+        }
 
-        instances.emplace_back(transform, parameterized_mesh_id);
+        if (!instance_groups[group_id].instances.empty()) {
+            group_instances.emplace_back(transform, group_id);
+        }
     }
 
     validate_materials();
@@ -913,10 +1328,10 @@ uint32_t Scene::load_pbrt_texture(
         std::string path = t->fileName;
         canonicalize_path(path);
         try {
-            Image img(pbrt_base_dir + "/" + path, t->fileName, SRGB);
+            Image img = load_texture(pbrt_base_dir + "/" + path, t->fileName, SRGB);
             const uint32_t id = textures.size();
             pbrt_textures[texture] = id;
-            textures.push_back(img);
+            textures.push_back(std::move(img));
             std::cout << "Loaded image texture: " << t->fileName << "\n";
             return id;
         } catch (const std::runtime_error &) {
@@ -932,6 +1347,124 @@ uint32_t Scene::load_pbrt_texture(
 
 #endif
 
+void Scene::deduplicate_textures()
+{
+    std::vector<uint32_t> texture_remap(textures.size());
+    std::vector<Image> unique_textures;
+    phmap::flat_hash_map<size_t, std::vector<uint32_t>> texture_hashes;
+    // Encoded textures aren't decoded to compare them, they're compared by their source
+    std::vector<std::string> unique_keys;
+    for (size_t i = 0; i < textures.size(); ++i) {
+        const Image &t = textures[i];
+        const std::string key = t.is_encoded() ? t.key() : std::string();
+        const size_t h = hash_buffer(
+            t.img,
+            phmap::HashState().combine(0,
+                                       t.width,
+                                       t.height,
+                                       t.channels,
+                                       static_cast<int>(t.color_space),
+                                       std::hash<std::string>()(key)));
+        auto &candidates = texture_hashes[h];
+        auto fnd = std::find_if(candidates.begin(), candidates.end(), [&](const uint32_t c) {
+            const Image &u = unique_textures[c];
+            return u.width == t.width && u.height == t.height && u.channels == t.channels &&
+                   u.color_space == t.color_space && unique_keys[c] == key && u.img == t.img;
+        });
+        if (fnd != candidates.end()) {
+            texture_remap[i] = *fnd;
+        } else {
+            texture_remap[i] = unique_textures.size();
+            candidates.push_back(texture_remap[i]);
+            unique_textures.push_back(std::move(textures[i]));
+            unique_keys.push_back(key);
+        }
+    }
+
+    if (unique_textures.size() == textures.size()) {
+        textures = std::move(unique_textures);
+        return;
+    }
+    std::cout << "Removed " << textures.size() - unique_textures.size()
+              << " duplicate textures\n";
+    textures = std::move(unique_textures);
+
+    auto remap_param = [&](float &param) {
+        uint32_t handle = *reinterpret_cast<uint32_t *>(&param);
+        if (IS_TEXTURED_PARAM(handle)) {
+            const uint32_t id = texture_remap[GET_TEXTURE_ID(handle)];
+            handle &= ~uint32_t(0x1fffffff);
+            SET_TEXTURE_ID(handle, id);
+            param = *reinterpret_cast<float *>(&handle);
+        }
+    };
+    for (auto &m : materials) {
+        remap_param(m.base_color.r);
+        remap_param(m.metallic);
+        remap_param(m.specular);
+        remap_param(m.roughness);
+        remap_param(m.specular_tint);
+        remap_param(m.anisotropy);
+        remap_param(m.sheen);
+        remap_param(m.sheen_tint);
+        remap_param(m.clearcoat);
+        remap_param(m.clearcoat_gloss);
+        remap_param(m.ior);
+        remap_param(m.specular_transmission);
+    }
+}
+
+void Scene::deduplicate_meshes()
+{
+    std::vector<size_t> mesh_remap(meshes.size());
+    std::vector<glm::vec3> mesh_offsets(meshes.size(), glm::vec3(0.f));
+    std::vector<Mesh> unique_meshes;
+    phmap::flat_hash_map<size_t, std::vector<size_t>> mesh_hashes;
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        size_t h = meshes[i].geometries.size();
+        for (const auto &g : meshes[i].geometries) {
+            h = phmap::HashState().combine(h, hash_geometry(g));
+        }
+        auto &candidates = mesh_hashes[h];
+        auto fnd = std::find_if(candidates.begin(), candidates.end(), [&](const size_t c) {
+            return find_mesh_offset(unique_meshes[c], meshes[i], mesh_offsets[i]);
+        });
+        if (fnd != candidates.end()) {
+            mesh_remap[i] = *fnd;
+        } else {
+            mesh_offsets[i] = glm::vec3(0.f);
+            mesh_remap[i] = unique_meshes.size();
+            candidates.push_back(mesh_remap[i]);
+            unique_meshes.push_back(std::move(meshes[i]));
+        }
+    }
+
+    if (unique_meshes.size() == meshes.size()) {
+        meshes = std::move(unique_meshes);
+        return;
+    }
+    std::cout << "Removed " << meshes.size() - unique_meshes.size()
+              << " duplicate meshes\n";
+    meshes = std::move(unique_meshes);
+
+    // Instances of translated copies now place the original mesh, so we need to
+    // apply the translation in the instance's transform
+    auto apply_offset = [&](Instance &i) {
+        const glm::vec3 &offset =
+            mesh_offsets[parameterized_meshes[i.parameterized_mesh_id].mesh_id];
+        if (offset != glm::vec3(0.f)) {
+            i.transform = i.transform * glm::translate(glm::mat4(1.f), offset);
+        }
+    };
+    std::for_each(instances.begin(), instances.end(), apply_offset);
+    for (auto &g : instance_groups) {
+        std::for_each(g.instances.begin(), g.instances.end(), apply_offset);
+    }
+    for (auto &pm : parameterized_meshes) {
+        pm.mesh_id = mesh_remap[pm.mesh_id];
+    }
+}
+
 void Scene::validate_materials()
 {
     const bool need_default_mat =
@@ -6,8 +6,10 @@
 #include "camera.h"
 #include "lights.h"
 #include "material.h"
+#include "memory_report.h"
 #include "mesh.h"
 #include "phmap.h"
+#include "render_params.h"
 
 #ifdef PBRT_PARSER_ENABLED
 #include "pbrtParser/Scene.h"
@@ -20,19 +22,40 @@
  */
 enum class MaterialMode { DEFAULT, WHITE_DIFFUSE };
 
+class FileMapping;
+
 struct Scene {
     std::vector<Mesh> meshes;
+    /* For out-of-core scenes the meshes are empty and their data is left in the memory
+     * mapped scene file, described by the streamed mesh with the same index. The
+     * mapping is kept open for backends to load the streamed meshes from
+     */
+    std::vector<StreamedMesh> streamed_meshes;
+    std::shared_ptr<FileMapping> mapping;
     std::vector<ParameterizedMesh> parameterized_meshes;
     std::vector<Instance> instances;
+    // Two-level instancing, the group instances are placed in the scene in addition to
+    // the instances. Backends which don't support it get the scene with its groups
+    // flattened into instances
+    std::vector<InstanceGroup> instance_groups;
+    std::vector<GroupInstance> group_instances;
     std::vector<DisneyMaterial> materials;
     std::vector<Image> textures;
+    // Equirectangular environment map lighting the scene, empty if there's none
+    HDRImage environment;
     std::vector<QuadLight> lights;
     std::vector<Camera> cameras;
     CameraParams camParams;
+    RenderParams render_params;
     uint32_t samples_per_pixel = 1;
     MaterialMode material_mode = MaterialMode::DEFAULT;
 
-    Scene(const std::string &fname, MaterialMode material_mode);
+    /* Load the scene from the file, the render params are needed at load time for
+     * out-of-core scenes
+     */
+    Scene(const std::string &fname,
+          MaterialMode material_mode,
+          const RenderParams &render_params = RenderParams());
     Scene() = default;
 
     // Compute the unique number of triangles in the scene
@@ -43,6 +66,27 @@ struct Scene {
 
     size_t num_geometries() const;
 
+    // Check if the scene's meshes are streamed from the scene file
+    bool out_of_core() const;
+
+    /* Add the memory used by the scene's mesh data and textures to the report. The mesh
+     * data of out-of-core scenes is left in the scene file and isn't counted
+     */
+    void memory_report(MemoryReport &report) const;
+
+    // Flatten the group instances into the top level instances
+    void flatten_instance_groups();
+
+    /* Release the materials, textures, environment map and lights, leaving the geometry
+     * and instances of the scene
+     */
+    void release_shading_data();
+
+    /* Make a copy of the scene with just the parameters and cameras, without the
+     * geometry, materials or textures
+     */
+    Scene parameters() const;
+
 private:
     void load_obj(const std::string &file);
 
@@ -50,6 +94,12 @@ private:
 
     void load_crts(const std::string &file);
 
+    /* Set the bounds of the streamed meshes from the file's bounds cache, or compute them
+     * from the mesh data and write the cache if it's missing or out of date
+     */
+    void load_streamed_mesh_bounds(const std::string &file,
+                                   const std::vector<size_t> &mesh_ids);
+
 #ifdef PBRT_PARSER_ENABLED
     void load_pbrt(const std::string &file);
 
@@ -66,5 +116,22 @@ private:
         phmap::parallel_flat_hash_map<pbrt::Texture::SP, size_t> &pbrt_textures);
 #endif
 
+    /* Load the image texture, textures paged in by the texture cache are left encoded and
+     * decoded on demand by the cache
+     */
+    Image load_texture(const std::string &file,
+                       const std::string &name,
+                       ColorSpace color_space) const;
+
     void validate_materials();
+
+    /* Remove textures with identical content, remapping the material texture handles
+     * to the remaining copy
+     */
+    void deduplicate_textures();
+
+    /* Remove meshes which are (possibly translated) copies of another mesh, the
+     * instances of the copy become instances of the original mesh
+     */
+    void deduplicate_meshes();
 };
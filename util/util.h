@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <string>
 #include <glm/glm.hpp>
 
@@ -21,3 +22,6 @@ float srgb_to_linear(const float x);
 float linear_to_srgb(const float x);
 
 float luminance(const glm::vec3 &c);
+
+// FNV-1a hash of the buffer's contents
+size_t hash_bytes(const void *data, const size_t size, size_t h = 14695981039346656037ull);